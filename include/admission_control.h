@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include <asio.h>
+#include <worker_load.h>
+#include <worker_metrics.h>
+
+/// Limits of one worker, zero leaves a limit out.
+struct admission_limits
+{
+    admission_limits()
+        : max_connections(0)
+        , max_in_flight(0)
+        , target_delay(0)
+        , interval(100)
+    {
+    }
+
+    /// Open connections, a worker over it rejects new ones and its
+    /// acceptors pause.
+    std::size_t max_connections;
+
+    /// Requests read and not yet written, including the one admitted.
+    std::size_t max_in_flight;
+
+    /// CoDel target of the time ready handlers wait in the event loop.
+    chrono::milliseconds target_delay;
+
+    /// CoDel interval, the time the delay must stay over the target before
+    /// requests are shed, about a round trip of the clients.
+    chrono::milliseconds interval;
+};
+
+/// The control law of CoDel (Nichols and Jacobson, "Controlling Queue
+/// Delay"), on the queueing delay of a worker instead of packets in a
+/// queue. Once every delay measured in an interval stayed above the target,
+/// requests are shed at a rate growing with the square root of the number
+/// shed, until a delay is measured below the target again.
+class codel
+{
+public:
+    typedef chrono::steady_clock clock;
+
+    codel()
+        : target_(0)
+        , interval_(0)
+        , dropping_(false)
+        , count_(0)
+        , last_count_(0)
+    {
+    }
+
+    void set(clock::duration target, clock::duration interval)
+    {
+        target_ = target;
+        interval_ = interval;
+    }
+
+    /// The queue delayed by delay at now.
+    void observe(clock::duration delay, clock::time_point now)
+    {
+        if(delay < target_)
+        {
+            first_above_ = clock::time_point();
+            dropping_ = false;
+            return;
+        }
+
+        if(first_above_ == clock::time_point())
+            first_above_ = now + interval_;
+    }
+
+    /// Whether to shed the request arriving now.
+    bool shed(clock::time_point now)
+    {
+        if(dropping_)
+        {
+            if(now < drop_next_)
+                return false;
+            ++count_;
+            drop_next_ = control_law(drop_next_);
+            return true;
+        }
+
+        if(first_above_ == clock::time_point() || now < first_above_)
+            return false;
+
+        // shedding again shortly after it stopped starts near the old rate
+        dropping_ = true;
+        std::size_t delta = count_ - last_count_;
+        count_ = delta > 1 && now - drop_next_ < 16 * interval_ ? delta : 1;
+        last_count_ = count_;
+        drop_next_ = control_law(now);
+        return true;
+    }
+
+private:
+    clock::time_point control_law(clock::time_point t) const
+    {
+        return t + chrono::duration_cast<clock::duration>(interval_ / std::sqrt(static_cast<double>(count_)));
+    }
+
+    clock::duration target_;
+
+    clock::duration interval_;
+
+    /// When the delay will have been above the target for an interval.
+    clock::time_point first_above_;
+
+    bool dropping_;
+
+    clock::time_point drop_next_;
+
+    std::size_t count_;
+
+    std::size_t last_count_;
+};
+
+/// Admission control of one io_context, see admission_limits. Connections
+/// over the limit are answered with a pre-serialized 503 and closed,
+/// requests over it are answered with one by their connection without
+/// reaching the handler. The limits are set before the io_context runs,
+/// accepts_connection() is read by acceptors on other threads.
+///
+/// The queueing delay driving codel is how late a probe timer runs every
+/// target_delay: the time ready handlers, e.g. the reads of requests
+/// waiting in the socket buffers, wait for the thread running the
+/// io_context. The time a handler itself takes does not count, only the
+/// time others wait behind it.
+class admission_control : public context_service<admission_control>
+{
+public:
+    explicit admission_control(asio::execution_context & context)
+        : context_service(context)
+        , load_(asio::use_service<worker_load>(context))
+        , metrics_(asio::use_service<worker_metrics>(context))
+        , limit_requests_(false)
+        , probe_timer_(static_cast<asio::io_context &>(context))
+    {
+    }
+
+    void set_limits(const admission_limits & limits)
+    {
+        limits_ = limits;
+        limit_requests_ = limits.max_in_flight != 0 || limits.target_delay.count() != 0;
+        codel_.set(limits.target_delay, limits.interval);
+        if(limits.target_delay.count() != 0)
+        {
+            next_probe_ = chrono::steady_clock::now() + limits_.target_delay;
+            probe();
+        }
+    }
+
+    const admission_limits & limits() const
+    {
+        return limits_;
+    }
+
+    /// Whether the worker takes another connection, from any thread.
+    bool accepts_connection() const
+    {
+        return limits_.max_connections == 0 || load_.connections() < limits_.max_connections;
+    }
+
+    /// Whether a request read is admitted. It is counted in flight, later
+    /// requests read after it are too and do not count against it.
+    bool admit_request(std::size_t later = 0)
+    {
+        if(!limit_requests_)
+            return true;
+
+        bool shed = limits_.max_in_flight != 0 && load_.outstanding() - later > limits_.max_in_flight;
+        if(!shed && limits_.target_delay.count() != 0)
+            shed = codel_.shed(chrono::steady_clock::now());
+        if(shed)
+            metrics_.request_shed();
+        return !shed;
+    }
+
+    /// Answer a new connection over the limit with a 503 and close it. The
+    /// send buffer of a new socket takes the response without blocking.
+    void reject(tcp::socket & sock)
+    {
+        metrics_.connection_rejected();
+        beast::string_view response = overloaded_response(false);
+        ssize_t n = ::send(sock.native_handle(), response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)n;
+        error_code ec;
+        sock.shutdown(tcp::socket::shutdown_send, ec);
+        sock.close(ec);
+    }
+
+    /// The 503 answering a request shed, serialized once.
+    static beast::string_view overloaded_response(bool keep_alive)
+    {
+        static const char keep[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+        static const char close[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        return keep_alive ? beast::string_view(keep, sizeof(keep) - 1) : beast::string_view(close, sizeof(close) - 1);
+    }
+
+private:
+    void shutdown() override
+    {
+        error_code ec;
+        probe_timer_.cancel(ec);
+    }
+
+    void probe()
+    {
+        probe_timer_.expires_at(next_probe_);
+        probe_timer_.async_wait([this](const error_code & ec)
+        {
+            if(ec)
+                return;
+            auto now = chrono::steady_clock::now();
+            codel_.observe(now - next_probe_, now);
+            next_probe_ = now + limits_.target_delay;
+            probe();
+        });
+    }
+
+    const worker_load & load_;
+
+    worker_metrics & metrics_;
+
+    admission_limits limits_;
+
+    bool limit_requests_;
+
+    codel codel_;
+
+    asio::steady_timer probe_timer_;
+
+    /// When the probe is due.
+    chrono::steady_clock::time_point next_probe_;
+};
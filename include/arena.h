@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include <boost/noncopyable.hpp>
+
+/// Monotonic memory of one pipeline slot. Allocation bumps a pointer,
+/// deallocation does nothing, and reset() recycles everything at once when
+/// the slot is popped. The first block is allocated on first use.
+class arena : private boost::noncopyable
+{
+    struct block
+    {
+        block * next_;
+
+        std::size_t size_;
+
+        char * data()
+        {
+            return reinterpret_cast<char *>(this + 1);
+        }
+    };
+
+public:
+    static const std::size_t initial_block_size = 4096;
+
+    arena()
+        : head_(nullptr)
+        , ptr_(nullptr)
+        , end_(nullptr)
+        , block_size_(initial_block_size)
+    {
+    }
+
+    ~arena()
+    {
+        release();
+    }
+
+    void * allocate(std::size_t size, std::size_t align)
+    {
+        char * p = align_up(ptr_, align);
+        if(p == nullptr || p > end_ || size > static_cast<std::size_t>(end_ - p))
+        {
+            grow(size + align);
+            p = align_up(ptr_, align);
+        }
+        ptr_ = p + size;
+        return p;
+    }
+
+    /// Recycle all memory. If it took more than one block, they are
+    /// replaced by a single one large enough for all of it.
+    void reset()
+    {
+        if(head_ == nullptr)
+            return;
+
+        if(head_->next_ != nullptr)
+        {
+            std::size_t total = 0;
+            for(block * b = head_; b != nullptr; b = b->next_)
+                total += b->size_;
+            release();
+            block_size_ = total;
+            return;
+        }
+
+        ptr_ = head_->data();
+    }
+
+    /// Free all memory, the next allocation starts a new block.
+    void release()
+    {
+        while(head_ != nullptr)
+        {
+            block * next = head_->next_;
+            ::operator delete(head_);
+            head_ = next;
+        }
+        ptr_ = nullptr;
+        end_ = nullptr;
+    }
+
+    /// Bytes held in blocks.
+    std::size_t capacity() const
+    {
+        std::size_t total = 0;
+        for(block * b = head_; b != nullptr; b = b->next_)
+            total += b->size_;
+        return total;
+    }
+
+private:
+    static char * align_up(char * p, std::size_t align)
+    {
+        std::uintptr_t n = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<char *>((n + align - 1) & ~(align - 1));
+    }
+
+    void grow(std::size_t min_size)
+    {
+        std::size_t size = std::max(block_size_, min_size);
+        block * b = static_cast<block *>(::operator new(sizeof(block) + size));
+        b->next_ = head_;
+        b->size_ = size;
+        head_ = b;
+        ptr_ = b->data();
+        end_ = ptr_ + size;
+        block_size_ = size * 2;
+    }
+
+    block * head_;
+
+    char * ptr_;
+
+    char * end_;
+
+    /// Size of the next block.
+    std::size_t block_size_;
+};
+
+/// Allocator of an arena. A default constructed one uses the heap, so
+/// messages created outside a connection keep working.
+template<typename T>
+class arena_allocator
+{
+    template<typename U> friend class arena_allocator;
+
+public:
+    typedef T value_type;
+
+    // a message moved into a slot brings its allocator along
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    arena_allocator() noexcept
+        : arena_(nullptr)
+    {
+    }
+
+    explicit arena_allocator(arena * a) noexcept
+        : arena_(a)
+    {
+    }
+
+    template<typename U>
+    arena_allocator(const arena_allocator<U> & other) noexcept
+        : arena_(other.arena_)
+    {
+    }
+
+    T * allocate(std::size_t n)
+    {
+        if(arena_ == nullptr)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T * p, std::size_t) noexcept
+    {
+        if(arena_ == nullptr)
+            ::operator delete(p);
+    }
+
+    template<typename U>
+    bool operator==(const arena_allocator<U> & other) const noexcept
+    {
+        return arena_ == other.arena_;
+    }
+
+    template<typename U>
+    bool operator!=(const arena_allocator<U> & other) const noexcept
+    {
+        return arena_ != other.arena_;
+    }
+
+private:
+    arena * arena_;
+};
+
+/// The allocator to create a message in a with, a std::allocator ignores it.
+template<typename Allocator>
+inline Allocator make_allocator(arena & a);
+
+template<>
+inline std::allocator<char> make_allocator<std::allocator<char> >(arena &)
+{
+    return std::allocator<char>();
+}
+
+template<>
+inline arena_allocator<char> make_allocator<arena_allocator<char> >(arena & a)
+{
+    return arena_allocator<char>(&a);
+}
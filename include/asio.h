@@ -2,11 +2,14 @@
 
 #define HTTP_DISABLE_THREADS
 #define HTTP_CONNECTION_TRACE
+//#define HTTP_ENABLE_ARENA
 
 #ifdef HTTP_DISABLE_THREADS
 #define BOOST_ASIO_DISABLE_THREADS
 #endif
 
+// boost/asio/awaitable.hpp of Boost 1.74 uses std::exchange without it
+#include <utility>
 #include <boost/asio.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/beast.hpp>
@@ -23,8 +26,20 @@ using udp = boost::asio::ip::udp;
 
 namespace beast = boost::beast;
 namespace http = boost::beast::http;
-using http_response = http::response<http::string_body>;
-using http_request = http::request<http::string_body>;
+
+// Allocate the fields and bodies of the messages in a pipeline slot from
+// an arena recycled with the slot. A message then must not outlive its slot.
+#ifdef HTTP_ENABLE_ARENA
+#include <arena.h>
+using http_allocator = arena_allocator<char>;
+#else
+using http_allocator = std::allocator<char>;
+#endif
+
+using http_fields = http::basic_fields<http_allocator>;
+using http_body = http::basic_string_body<char, std::char_traits<char>, http_allocator>;
+using http_response = http::response<http_body, http_fields>;
+using http_request = http::request<http_body, http_fields>;
 
 namespace chrono = std::chrono;
 
@@ -45,15 +60,41 @@ inline shared_ptr<_Tp> make_shared(_Args&&... args)
     return std::__make_shared<_Tp, std::_Lock_policy::_S_single, _Args...>(std::forward<_Args>(args)...);
 }
 
+template<typename _Tp, typename _Alloc, typename... _Args>
+inline shared_ptr<_Tp> allocate_shared(const _Alloc & a, _Args&&... args)
+{
+    return std::__allocate_shared<_Tp, std::_Lock_policy::_S_single>(a, std::forward<_Args>(args)...);
+}
+
 #else
 
 using std::shared_ptr;
 using std::enable_shared_from_this;
 using std::weak_ptr;
 using std::make_shared;
+using std::allocate_shared;
 
 #endif
 
+/// Base of the services of an io_context. The id is a static member of a
+/// class template, so a header defining a service can be included by more
+/// than one translation unit.
+template<typename Service>
+class context_service : public asio::execution_context::service
+{
+public:
+    static asio::execution_context::id id;
+
+protected:
+    explicit context_service(asio::execution_context & context)
+        : asio::execution_context::service(context)
+    {
+    }
+};
+
+template<typename Service>
+asio::execution_context::id context_service<Service>::id;
+
 namespace boost
 {
 namespace asio
@@ -63,6 +104,10 @@ namespace external
 
 typedef asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_REUSEPORT> reuse_port;
 
+typedef asio::detail::socket_option::integer<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_INCOMING_CPU> incoming_cpu;
+
+typedef asio::detail::socket_option::integer<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_BUSY_POLL> busy_poll;
+
 }
 }
 }
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+
+#include <asio.h>
+#include <worker_load.h>
+
+/// Run mode of a latency critical worker: spin on poll() for a bounded
+/// time before blocking in the reactor, which saves the wakeup of an
+/// epoll sleep when the next event follows shortly.
+struct busy_poll
+{
+    busy_poll()
+        : spin(0)
+        , socket_busy_poll(0)
+    {
+    }
+
+    explicit busy_poll(chrono::microseconds s, int socket_us = 0)
+        : spin(s)
+        , socket_busy_poll(socket_us)
+    {
+    }
+
+    /// Longest time to spin before blocking, zero runs the io_context normally.
+    chrono::microseconds spin;
+
+    /// SO_BUSY_POLL in microseconds for accepted sockets, zero leaves it unset.
+    int socket_busy_poll;
+
+    /// Apply to an accepted socket.
+    void bind_socket(tcp::socket & sock) const
+    {
+        if(socket_busy_poll > 0)
+        {
+            error_code ec;
+            sock.set_option(asio::external::busy_poll(socket_busy_poll), ec);
+        }
+    }
+
+    /// Run context until it is stopped. The spin budget is halved every
+    /// time spinning found no work, down to a sixteenth of spin, and doubled
+    /// every time it did. Spin and sleep time are added to load.
+    void run(asio::io_context & context, worker_load & load) const
+    {
+        if(spin.count() == 0)
+        {
+            context.run();
+            return;
+        }
+
+        typedef chrono::steady_clock clock;
+        const clock::duration max_budget = spin;
+        const clock::duration min_budget = std::max<clock::duration>(max_budget / 16, clock::duration(1));
+        clock::duration budget = max_budget;
+
+        while(!context.stopped())
+        {
+            if(context.poll() != 0)
+                continue;
+
+            clock::time_point start = clock::now();
+            clock::time_point now = start;
+            std::size_t n = 0;
+            while(now - start < budget && !context.stopped())
+            {
+                n = context.poll();
+                if(n != 0)
+                    break;
+                now = clock::now();
+            }
+            load.spun(chrono::duration_cast<chrono::nanoseconds>(now - start));
+
+            if(n != 0)
+            {
+                budget = std::min(budget * 2, max_budget);
+                continue;
+            }
+            budget = std::max(budget / 2, min_budget);
+
+            context.run_one();
+            load.slept(chrono::duration_cast<chrono::nanoseconds>(clock::now() - now));
+        }
+    }
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <boost/intrusive/list.hpp>
+
+#include <asio.h>
+
+/// Hook a connection type derives from to be linked into its connection_list,
+/// it unlinks itself when the connection is destroyed.
+typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink> > connection_hook;
+
+/// The connections living on one io_context.
+///
+/// Only the thread running the io_context touches the list, linking and
+/// unlinking are O(1) and do not allocate.
+template<typename Connection>
+class connection_list : public asio::execution_context::service
+{
+    typedef boost::intrusive::list<Connection, boost::intrusive::constant_time_size<false> > list_type;
+
+public:
+    static asio::execution_context::id id;
+
+    explicit connection_list(asio::execution_context & context)
+        : asio::execution_context::service(context)
+    {
+    }
+
+    void insert(Connection & c)
+    {
+        list_.push_back(c);
+    }
+
+    void erase(Connection & c)
+    {
+        c.unlink();
+    }
+
+    /// Call f on connections until it returns false. f must not unlink them.
+    template<typename Function>
+    void for_each(Function f)
+    {
+        for(auto iter = list_.begin(); iter != list_.end(); ++iter)
+        {
+            if(!f(*iter))
+                break;
+        }
+    }
+
+private:
+    void shutdown() override
+    {
+    }
+
+    list_type list_;
+};
+
+template<typename Connection>
+asio::execution_context::id connection_list<Connection>::id;
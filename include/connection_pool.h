@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <asio.h>
+
+/// Recycled connections of one io_context.
+///
+/// create() allocates a connection together with its shared_ptr control
+/// block from a free list of blocks, and a connection keeps its warm
+/// buffers (a Connection::storage) here between its destruction and the
+/// construction of the next one, up to a number of connections and of bytes
+/// of their buffers. Only the thread running the io_context
+/// uses the pool. A block freed on another thread, e.g. of a connection
+/// migrated to another worker, or after the pool is shut down goes back to
+/// the heap instead.
+template<typename Connection>
+class connection_pool : public asio::execution_context::service
+{
+    typedef typename Connection::storage storage;
+
+    /// The free blocks, shared with the allocators in the control blocks of
+    /// the connections, which may outlive the pool.
+    struct block_list
+    {
+        block_list()
+            : size_(0)
+            , capacity_(1024)
+            , stopped_(false)
+        {
+        }
+
+        ~block_list()
+        {
+            for(auto i : free_)
+                ::operator delete(i);
+        }
+
+        /// The thread allocating the blocks, the only one reusing them.
+        std::thread::id owner_;
+
+        /// Size of the blocks recycled, the first one allocated.
+        std::size_t size_;
+
+        std::size_t capacity_;
+
+        std::vector<void *> free_;
+
+        std::atomic<bool> stopped_;
+    };
+
+public:
+    static asio::execution_context::id id;
+
+    /// Allocator of allocate_shared() recycling the blocks of one size.
+    template<typename T>
+    class allocator
+    {
+        template<typename U> friend class allocator;
+
+    public:
+        typedef T value_type;
+
+        explicit allocator(const shared_ptr<block_list> & blocks) noexcept
+            : blocks_(blocks)
+        {
+        }
+
+        template<typename U>
+        allocator(const allocator<U> & other) noexcept
+            : blocks_(other.blocks_)
+        {
+        }
+
+        T * allocate(std::size_t n)
+        {
+            return static_cast<T *>(allocate_block(*blocks_, n * sizeof(T)));
+        }
+
+        void deallocate(T * p, std::size_t n) noexcept
+        {
+            deallocate_block(*blocks_, p, n * sizeof(T));
+        }
+
+        template<typename U>
+        bool operator==(const allocator<U> & other) const noexcept
+        {
+            return blocks_ == other.blocks_;
+        }
+
+        template<typename U>
+        bool operator!=(const allocator<U> & other) const noexcept
+        {
+            return blocks_ != other.blocks_;
+        }
+
+    private:
+        shared_ptr<block_list> blocks_;
+    };
+
+    explicit connection_pool(asio::execution_context & context)
+        : asio::execution_context::service(context)
+        , capacity_(1024)
+        , max_bytes_(64 * 1024 * 1024)
+        , bytes_(0)
+        , blocks_(::make_shared<block_list>())
+        , stopped_(false)
+    {
+    }
+
+    /// Most connections kept for reuse, the rest is freed.
+    void set_capacity(std::size_t capacity)
+    {
+        capacity_ = capacity;
+        blocks_->capacity_ = capacity;
+    }
+
+    /// Most bytes of buffers kept for reuse, see storage::memory_usage().
+    /// The buffers of a connection that would go over it are freed, e.g.
+    /// after a large request grew them.
+    void set_max_bytes(std::size_t bytes)
+    {
+        max_bytes_ = bytes;
+    }
+
+    /// Connections recycled and ready for reuse.
+    std::size_t size() const
+    {
+        return storages_.size();
+    }
+
+    /// Bytes of the buffers kept.
+    std::size_t bytes() const
+    {
+        return bytes_;
+    }
+
+    template<typename... Args>
+    shared_ptr<Connection> create(Args &&... args)
+    {
+        return ::allocate_shared<Connection>(allocator<Connection>(blocks_), std::forward<Args>(args)...);
+    }
+
+    /// The buffers of a destroyed connection, null if there are none.
+    std::unique_ptr<storage> take()
+    {
+        std::unique_ptr<storage> s;
+        if(!storages_.empty())
+        {
+            s = std::move(storages_.back());
+            storages_.pop_back();
+            bytes_ -= s->memory_usage();
+        }
+        return s;
+    }
+
+    /// Keep the buffers of a connection being destroyed.
+    void give(std::unique_ptr<storage> s)
+    {
+        std::size_t size = s->memory_usage();
+        if(stopped_ || storages_.size() >= capacity_ || bytes_ + size > max_bytes_)
+            return;
+        bytes_ += size;
+        storages_.push_back(std::move(s));
+    }
+
+private:
+    void shutdown() override
+    {
+        stopped_ = true;
+        blocks_->stopped_.store(true, std::memory_order_relaxed);
+        storages_.clear();
+        bytes_ = 0;
+    }
+
+    static void * allocate_block(block_list & blocks, std::size_t size)
+    {
+        if(blocks.size_ == 0)
+        {
+            blocks.size_ = size;
+            blocks.owner_ = std::this_thread::get_id();
+        }
+
+        if(size == blocks.size_ && !blocks.free_.empty())
+        {
+            void * p = blocks.free_.back();
+            blocks.free_.pop_back();
+            return p;
+        }
+        return ::operator new(size);
+    }
+
+    static void deallocate_block(block_list & blocks, void * p, std::size_t size)
+    {
+        if(blocks.stopped_.load(std::memory_order_relaxed) || std::this_thread::get_id() != blocks.owner_
+            || size != blocks.size_ || blocks.free_.size() >= blocks.capacity_)
+        {
+            ::operator delete(p);
+            return;
+        }
+        blocks.free_.push_back(p);
+    }
+
+    std::size_t capacity_;
+
+    std::size_t max_bytes_;
+
+    std::size_t bytes_;
+
+    shared_ptr<block_list> blocks_;
+
+    std::vector<std::unique_ptr<storage> > storages_;
+
+    bool stopped_;
+};
+
+template<typename Connection>
+asio::execution_context::id connection_pool<Connection>::id;
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <asio.h>
+
+/// Recycled coroutine frames of one io_context, see http_coroutine.h.
+///
+/// Frames are kept in free lists by size, in classes of granularity bytes
+/// up to max_size, a larger frame comes from the heap. A block starts with
+/// a header naming its pool and class, a frame is freed without knowing
+/// where it was allocated. Only the thread running the io_context, the one
+/// its coroutines run on, allocates and frees frames. Frames freed once
+/// the pool is shut down go back to the heap.
+class coroutine_frame_pool : public context_service<coroutine_frame_pool>
+{
+    struct alignas(alignof(std::max_align_t)) header
+    {
+        coroutine_frame_pool * pool_;
+
+        /// Size class, class_count for a frame from the heap.
+        std::size_t class_;
+    };
+
+public:
+    static const std::size_t granularity = 64;
+
+    static const std::size_t max_size = 4096;
+
+    static const std::size_t class_count = max_size / granularity;
+
+    explicit coroutine_frame_pool(asio::execution_context & context)
+        : context_service(context)
+        , capacity_(256)
+        , heap_allocations_(0)
+        , stopped_(false)
+        , free_(class_count)
+    {
+    }
+
+    ~coroutine_frame_pool()
+    {
+        for(auto & blocks : free_)
+            for(auto i : blocks)
+                ::operator delete(i);
+    }
+
+    /// Most free blocks kept of each size class, the rest is freed.
+    void set_capacity(std::size_t capacity)
+    {
+        capacity_ = capacity;
+    }
+
+    /// Frames that did not find a free block, a steady load stops adding to it.
+    std::size_t heap_allocations() const
+    {
+        return heap_allocations_;
+    }
+
+    void * allocate(std::size_t size)
+    {
+        std::size_t index = (size + sizeof(header) - 1) / granularity;
+        header * h;
+        if(index < class_count && !free_[index].empty())
+        {
+            h = static_cast<header *>(free_[index].back());
+            free_[index].pop_back();
+        }
+        else
+        {
+            ++heap_allocations_;
+            h = static_cast<header *>(::operator new(index < class_count ? (index + 1) * granularity : size + sizeof(header)));
+        }
+
+        h->pool_ = this;
+        h->class_ = index < class_count ? index : class_count;
+        return h + 1;
+    }
+
+    static void deallocate(void * p)
+    {
+        header * h = static_cast<header *>(p) - 1;
+        coroutine_frame_pool & pool = *h->pool_;
+        if(h->class_ == class_count || pool.stopped_ || pool.free_[h->class_].size() >= pool.capacity_)
+        {
+            ::operator delete(h);
+            return;
+        }
+        pool.free_[h->class_].push_back(h);
+    }
+
+private:
+    void shutdown() override
+    {
+        stopped_ = true;
+    }
+
+    std::size_t capacity_;
+
+    std::size_t heap_allocations_;
+
+    bool stopped_;
+
+    std::vector<std::vector<void *> > free_;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+/// Memory for the one asynchronous operation a connection has in flight
+/// on its read or its write side. The block is kept for the next
+/// operation, which saves Asio's allocation when its per thread cache
+/// is taken by other connections.
+class handler_memory : private boost::noncopyable
+{
+public:
+    handler_memory()
+        : block_(nullptr)
+        , size_(0)
+        , in_use_(false)
+    {
+    }
+
+    /// Moved between connections by their connection_pool.
+    handler_memory(handler_memory && other) noexcept
+        : block_(other.block_)
+        , size_(other.size_)
+        , in_use_(other.in_use_)
+    {
+        other.block_ = nullptr;
+        other.size_ = 0;
+        other.in_use_ = false;
+    }
+
+    handler_memory & operator=(handler_memory && other) noexcept
+    {
+        if(this != &other)
+        {
+            ::operator delete(block_);
+            block_ = other.block_;
+            size_ = other.size_;
+            in_use_ = other.in_use_;
+            other.block_ = nullptr;
+            other.size_ = 0;
+            other.in_use_ = false;
+        }
+        return *this;
+    }
+
+    ~handler_memory()
+    {
+        ::operator delete(block_);
+    }
+
+    void * allocate(std::size_t size)
+    {
+        if(in_use_)
+            return ::operator new(size);
+
+        if(size > size_)
+        {
+            ::operator delete(block_);
+            block_ = nullptr;
+            size_ = 0;
+            block_ = ::operator new(size);
+            size_ = size;
+        }
+        in_use_ = true;
+        return block_;
+    }
+
+    void deallocate(void * p)
+    {
+        if(p == block_)
+            in_use_ = false;
+        else
+            ::operator delete(p);
+    }
+
+    /// Free the block unless an operation holds it.
+    void release()
+    {
+        if(in_use_)
+            return;
+        ::operator delete(block_);
+        block_ = nullptr;
+        size_ = 0;
+    }
+
+    std::size_t capacity() const
+    {
+        return size_;
+    }
+
+private:
+    void * block_;
+
+    std::size_t size_;
+
+    bool in_use_;
+};
+
+/// Allocator of a handler_memory, associated with a handler through
+/// custom_alloc_handler.
+template<typename T>
+class handler_allocator
+{
+    template<typename U> friend class handler_allocator;
+
+public:
+    typedef T value_type;
+
+    explicit handler_allocator(handler_memory & memory) noexcept
+        : memory_(&memory)
+    {
+    }
+
+    template<typename U>
+    handler_allocator(const handler_allocator<U> & other) noexcept
+        : memory_(other.memory_)
+    {
+    }
+
+    T * allocate(std::size_t n)
+    {
+        return static_cast<T *>(memory_->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T * p, std::size_t) noexcept
+    {
+        memory_->deallocate(p);
+    }
+
+    template<typename U>
+    bool operator==(const handler_allocator<U> & other) const noexcept
+    {
+        return memory_ == other.memory_;
+    }
+
+    template<typename U>
+    bool operator!=(const handler_allocator<U> & other) const noexcept
+    {
+        return memory_ != other.memory_;
+    }
+
+private:
+    handler_memory * memory_;
+};
+
+/// Wraps a completion handler so its operation is allocated from memory.
+template<typename Handler>
+class custom_alloc_handler
+{
+public:
+    typedef handler_allocator<Handler> allocator_type;
+
+    custom_alloc_handler(handler_memory & memory, Handler h)
+        : memory_(memory)
+        , handler_(std::move(h))
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(memory_);
+    }
+
+    template<typename... Args>
+    void operator()(Args &&... args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    handler_memory & memory_;
+
+    Handler handler_;
+};
+
+template<typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_memory & memory, Handler h)
+{
+    return custom_alloc_handler<Handler>(memory, std::move(h));
+}
@@ -3,7 +3,26 @@
 #include <array>
 #include <functional>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/optional.hpp>
+
+#include <admission_control.h>
+#include <arena.h>
 #include <asio.h>
+#include <connection_list.h>
+#include <connection_pool.h>
+#include <handler_memory.h>
+#include <http_range.h>
+#include <loop_monitor.h>
+#include <request_trace.h>
+#include <timer_wheel.h>
+#include <worker_load.h>
+#include <worker_metrics.h>
 
 //an HTTP server connection
 
@@ -38,6 +57,11 @@ public:
         other.index_ = invalid_index;
     }
     
+    http_request & request()
+    {
+        return connection_->request(index_);
+    }
+    
     http_response & response()
     {
         return connection_->response(index_);
@@ -48,11 +72,100 @@ public:
         return connection_->response(index_);
     }
     
+    /// The request body, in place in the read buffer when the connection
+    /// left it there (see http_connection::enable_body_view()), else the
+    /// body of request(). Valid until the response is written or release_body().
+    beast::string_view request_body()
+    {
+        return connection_->request_body(index_);
+    }
+    
+    /// Done with request_body(), the connection may read over it again.
+    void release_body()
+    {
+        connection_->release_body(index_);
+    }
+    
+    /// Hand the next piece of the request body to cb together with this
+    /// context, which is moved into the connection until then. A piece is
+    /// valid until read_body() is called again, an empty one ends the body.
+    /// A streamed body is read from the socket only while asked for.
+    template<typename Callback>
+    void read_body(Callback && cb)
+    {
+        ConnectionPtr c = connection_;
+        std::size_t index = index_;
+        c->read_body(index, std::move(*this), std::forward<Callback>(cb));
+    }
+    
+    /// Send body as the response body without copying it, e.g. request_body().
+    /// It must stay valid until the response is written. Sets Content-Length,
+    /// prepare_payload() must not be called afterwards.
+    void set_response_body(beast::string_view body)
+    {
+        connection_->set_response_body(index_, body);
+    }
+    
+    /// Send the file at path as the response body, or the byte range of it
+    /// asked for by the request. Sets the status, Content-Length and the
+    /// range headers, commit() as usual. False if the file can't be opened.
+    bool set_response_file(const char * path)
+    {
+        return connection_->set_response_file(index_, path);
+    }
+    
+    /// Send size bytes of fd from offset as the response body, the
+    /// connection closes fd once the response is written.
+    void set_response_file(int fd, std::uint64_t offset, std::uint64_t size)
+    {
+        connection_->set_response_file(index_, fd, offset, size);
+    }
+    
+    /// Start a chunked response. response() is sent as the header once the
+    /// responses before it are written, write_chunk() and finish() follow.
+    /// A body set before is sent as the first chunk. An HTTP/1.0 client gets
+    /// the body without chunks, closed by the end of the connection. False
+    /// if the connection stopped or the body is a file, commit() that.
+    bool begin()
+    {
+        return connection_->begin(index_);
+    }
+    
+    /// Send data as the next chunk, starting the response if begin() was
+    /// not called. This context is moved into the connection and handed back
+    /// to cb once data is written, so the producer waits while the socket
+    /// takes no more. data must stay valid until then.
+    template<typename Callback>
+    void write_chunk(beast::string_view data, Callback && cb)
+    {
+        ConnectionPtr c = connection_;
+        std::size_t index = index_;
+        c->write_chunk(index, std::move(*this), data, std::forward<Callback>(cb));
+    }
+    
+    /// Send the last chunk, the chunked response is complete like after commit().
+    bool finish()
+    {
+        // only call once
+        if(index_ == invalid_index)
+            return false;
+        bool result = connection_->finish(index_);
+        index_ = invalid_index;
+        return result;
+    }
+    
     ConnectionPtr & connection()
     {
         return connection_;
     }
     
+    /// False once committed or finished, or moved from.
+    bool valid() const
+    {
+        return index_ != invalid_index;
+    }
+    
+    /// Complete the response, after begin() like finish().
     bool commit() 
     {
         // only call once
@@ -69,7 +182,41 @@ private:
     std::size_t index_;
 };
 
-class http_connection : public enable_shared_from_this<http_connection>
+template<typename Handler>
+class basic_http_connection;
+
+/// The handler of http_connection, calling back through std::function.
+struct http_function_handler
+{
+    typedef basic_http_connection<http_function_handler> connection;
+    
+    typedef http_context<shared_ptr<connection> > context;
+    
+    void handle_request(context && ctx, http_request & request)
+    {
+        request_callback_(std::move(ctx), request);
+    }
+    
+    void handle_close(shared_ptr<connection> c)
+    {
+        close_callback_(c);
+    }
+    
+    std::function<void(context &&, http_request &)> request_callback_;
+    
+    std::function<void(shared_ptr<connection>)> close_callback_;
+};
+
+/// An HTTP server connection calling Handler, bound at compile time so the
+/// request path may be inlined. Handler provides
+///
+///     void handle_request(context && ctx, http_request & request);
+///     void handle_close(shared_ptr<basic_http_connection> c);
+///
+/// The workers drain and migrate http_connection, or the connection_type
+/// named by their factory.
+template<typename Handler>
+class basic_http_connection : public enable_shared_from_this<basic_http_connection<Handler> >, public connection_hook
 {
     struct http_pipeline
     {
@@ -85,21 +232,31 @@ class http_connection : public enable_shared_from_this<http_connection>
             return first_ == (last_+1)% data_.size();
         }
         
+        std::size_t size()
+        {
+            return (last_ + data_.size() - first_) % data_.size();
+        }
+        
         bool ready()
         {
-            return (first_ != last_) && data_[first_].ready_;
+            return (first_ != last_) && at(first_).ready_;
+        }
+        
+        std::size_t next(std::size_t index)
+        {
+            return (index+1)%data_.size();
         }
         
         http_response & front()
         {
             assert(first_ != last_);
-            return data_[first_].response_;
+            return at(first_).response_;
         }
         
         void pop()
         {
             assert(first_ != last_);
-            data_[first_].reset();
+            at(first_).reset();
             first_ = (first_+1)%data_.size();
         }
         
@@ -115,36 +272,220 @@ class http_connection : public enable_shared_from_this<http_connection>
             return last_;
         }
         
+        struct pipeline_data;
+        
+        /// The slot at index, allocated on first use.
+        pipeline_data & at(std::size_t index)
+        {
+            if(!data_[index])
+                data_[index].reset(new pipeline_data);
+            return *data_[index];
+        }
+        
+        /// Reset the slots still in use.
+        void clear()
+        {
+            while(first_ != last_)
+                pop();
+            first_ = 0;
+            last_ = 0;
+        }
+        
+        /// Set the number of slots of an empty pipeline.
+        void resize(std::size_t size)
+        {
+            assert(first_ == last_);
+            first_ = 0;
+            last_ = 0;
+            data_.resize(size);
+        }
+        
+        /// Free every slot of an empty pipeline, requests start at the first
+        /// slot again so a pipeline one deep allocates one.
+        void shrink()
+        {
+            assert(first_ == last_);
+            first_ = 0;
+            last_ = 0;
+            for(auto & i : data_)
+                i.reset();
+        }
+        
+        /// Bytes of the allocated slots.
+        std::size_t memory_usage() const
+        {
+            std::size_t size = data_.capacity() * sizeof(data_[0]);
+            for(auto & i : data_)
+            {
+                if(!i)
+                    continue;
+                size += sizeof(pipeline_data) + i->arena_.capacity();
+                #ifndef HTTP_ENABLE_ARENA
+                size += i->request_.body().capacity() + i->response_.body().capacity();
+                #endif
+            }
+            return size;
+        }
+        
         void commit(std::size_t index)
         {
-            assert(data_[index].ready_ == false);
-            data_[index].ready_ = true;
+            assert(at(index).ready_ == false);
+            at(index).ready_ = true;
         }
         
         struct pipeline_data
         {
             pipeline_data()
                 : ready_(false)
+                , pinned_(false)
+                , streamed_(false)
+                , body_done_(false)
+                , chunked_(false)
+                , finished_(false)
+                , chunk_sent_(false)
+                , last_sent_(false)
+                , file_(-1)
+                , file_offset_(0)
+                , file_size_(0)
+                , request_(make_message<http_request>(arena_))
+                , response_(make_message<http_response>(arena_))
+                , size_(0)
+            {
+            }
+            
+            ~pipeline_data()
             {
+                close_file();
+            }
+            
+            void close_file()
+            {
+                if(file_ != -1)
+                    ::close(file_);
+                file_ = -1;
+                file_offset_ = 0;
+                file_size_ = 0;
             }
             
             void reset()
             {
                 ready_ = false;
+                pinned_ = false;
+                streamed_ = false;
+                body_done_ = false;
+                chunked_ = false;
+                finished_ = false;
+                chunk_sent_ = false;
+                last_sent_ = false;
+                trace_.clear();
+                chunk_ = beast::string_view();
+                close_file();
+                body_view_ = beast::string_view();
+                response_view_ = beast::string_view();
+                preserialized_ = beast::string_view();
+                serializer_ = boost::none;
+                
+                // free the messages before their memory is recycled
+                request_ = http_request{};
                 response_ = http_response{};
+                arena_.reset();
+                request_ = make_message<http_request>(arena_);
+                response_ = make_message<http_response>(arena_);
             }
             
             bool ready_;
+            
+            // the request body is body_view_, in the read buffer
+            bool pinned_;
+            beast::string_view body_view_;
+            
+            // the body is parsed after the request callback, read_body() reached its end
+            bool streamed_;
+            bool body_done_;
+            
+            // sent after the header of response_ when not empty
+            beast::string_view response_view_;
+            
+            // sent instead of response_ when not empty, e.g. a 503 of admission_control
+            beast::string_view preserialized_;
+            
+            typedef http_context<shared_ptr<basic_http_connection> > context;
+            
+            // a response of begin(), write_chunk() and finish()
+            bool chunked_;
+            bool finished_;
+            
+            // the chunk to write next, its producer waits for it in chunk_context_
+            beast::string_view chunk_;
+            boost::optional<context> chunk_context_;
+            std::function<void(context &&, const error_code &)> chunk_callback_;
+            char chunk_header_[20];
+            
+            // the chunk-size line of a body set before begin()
+            char response_header_[20];
+            
+            // the chunk or the last chunk are in the write in flight
+            bool chunk_sent_;
+            bool last_sent_;
+            
+            // sent with sendfile() after the header of response_ when not -1
+            int file_;
+            std::uint64_t file_offset_;
+            std::uint64_t file_size_;
+            
+            // memory of request_ and response_ when HTTP_ENABLE_ARENA is defined
+            arena arena_;
+            
+            http_request request_;
             http_response response_;
+            
+            // serializes response_ while it is written
+            boost::optional<http::response_serializer<http_body, http_fields> > serializer_;
+            
+            // bytes of the serializer in the write in flight
+            std::size_t size_;
+            
+            // the request was read, the response committed
+            chrono::steady_clock::time_point queued_;
+            chrono::steady_clock::time_point committed_;
+            
+            // stamps of the request when it is sampled, see request_tracer
+            request_trace trace_;
         };
         
         std::size_t first_;
         std::size_t last_;
-        std::vector<pipeline_data> data_;
+        std::vector<std::unique_ptr<pipeline_data> > data_;
+    };
+    
+    typedef typename http_pipeline::pipeline_data pipeline_data;
+    
+    typedef http::request_parser<http_body, http_allocator> request_parser;
+    
+    typedef http::request_parser<http::buffer_body, http_allocator> stream_parser;
+    
+    enum read_phase
+    {
+        phase_none,
+        phase_idle,
+        phase_header,
+        phase_body,
     };
     
+    /// Largest request body, copied or left in the buffer.
+    static const std::uint64_t body_limit = 1024 * 1024;
+    
+    /// An empty message allocating from a, or from the heap without HTTP_ENABLE_ARENA.
+    template<typename Message>
+    static Message make_message(arena & a)
+    {
+        typedef typename Message::body_type::value_type::allocator_type body_allocator;
+        typedef typename Message::allocator_type fields_allocator;
+        return Message(std::piecewise_construct, std::make_tuple(make_allocator<body_allocator>(a)), std::make_tuple(make_allocator<fields_allocator>(a)));
+    }
+    
 public:
-    using context = http_context<shared_ptr<http_connection> >;
+    using context = http_context<shared_ptr<basic_http_connection> >;
     
     #ifdef HTTP_CONNECTION_TRACE
     static uint64_t connectionCount_;
@@ -152,26 +493,170 @@ public:
     
     typedef std::function<void(context && , http_request &)> request_callback;
     
-    typedef std::function<void(shared_ptr<http_connection>)> close_callback;
+    /// A request of a batch with the context of its response.
+    struct batch_entry
+    {
+        context context_;
+        http_request & request_;
+    };
+    
+    /// Receives every request parsed from one read at once, e.g. to look
+    /// them up in a backend together. Contexts may be moved out.
+    typedef std::function<void(std::vector<batch_entry> &)> batch_request_callback;
+    
+    /// Called once a chunk is written, see context::write_chunk().
+    typedef std::function<void(context &&, const error_code &)> chunk_callback;
+    
+    /// Receives a piece of a request body, see context::read_body().
+    typedef std::function<void(context &&, const error_code &, beast::string_view)> body_callback;
+    
+    typedef std::function<void(shared_ptr<basic_http_connection>)> close_callback;
+    
+    /// Deadlines after which the connection is stopped, zero disables one.
+    struct timeouts
+    {
+        /// Waiting for the next request with nothing buffered.
+        chrono::milliseconds idle_;
+        
+        /// Reading a request header, from its first read.
+        chrono::milliseconds header_;
+        
+        /// Between reads of a request body.
+        chrono::milliseconds body_;
+        
+        /// A write making no progress.
+        chrono::milliseconds write_;
+    };
+    
+    typedef std::function<void(shared_ptr<basic_http_connection>)> adopt_callback;
+    
+    /// The buffers a connection_pool keeps from a destroyed connection for
+    /// the next one on its worker.
+    struct storage
+    {
+        storage()
+            : pipeline_(0)
+        {
+        }
+        
+        beast::flat_buffer buffer_;
+        
+        http_pipeline pipeline_;
+        
+        std::vector<char> window_;
+        
+        std::vector<asio::const_buffer> write_buffers_;
+        
+        std::vector<std::size_t> batch_;
+        
+        handler_memory read_memory_;
+        
+        handler_memory write_memory_;
+        
+        /// Bytes of the buffers.
+        std::size_t memory_usage() const
+        {
+            return buffer_.capacity() + window_.capacity() + write_buffers_.capacity() * sizeof(asio::const_buffer)
+                + batch_.capacity() * sizeof(std::size_t) + read_memory_.capacity() + write_memory_.capacity() + pipeline_.memory_usage();
+        }
+    };
     
-    explicit http_connection(tcp::socket && sock, request_callback rc, close_callback cc, std::size_t pipeline_size, std::size_t limit = std::numeric_limits<std::size_t>::max())
+    explicit basic_http_connection(tcp::socket && sock, Handler handler, std::size_t pipeline_size, std::size_t limit = std::numeric_limits<std::size_t>::max())
         : socket_(std::move(sock))
+        , load_(&asio::use_service<worker_load>(socket_.get_executor().context()))
+        , metrics_(&asio::use_service<worker_metrics>(socket_.get_executor().context()))
+        , tracer_(&asio::use_service<request_tracer>(socket_.get_executor().context()))
+        , monitor_(&asio::use_service<loop_monitor>(socket_.get_executor().context()))
+        , admission_(&asio::use_service<admission_control>(socket_.get_executor().context()))
+        , trace_connection_(0)
+        , trace_accepted_(0)
+        , timers_(&asio::use_service<timer_wheel>(socket_.get_executor().context()))
+        , timeouts_()
+        , read_phase_(phase_none)
+        , read_timer_([this]() { handle_timeout(); })
+        , write_timer_([this]() { handle_timeout(); })
+        , idle_release_(0)
+        , release_timer_([this]() { release_memory(); })
         , stopped_(false)
+        , idle_(false)
+        , draining_(false)
+        , served_(false)
+        , reading_(false)
+        , writing_(false)
+        , migrate_target_(nullptr)
         , buffer_(limit)
-        , pipeline_(pipeline_size)
-        , request_callback_(rc)
-        , close_callback_(cc)
+        , pipeline_(0)
+        , body_view_size_(0)
+        , pinned_(0)
+        , stream_size_(0)
+        , window_size_(0)
+        , stream_index_(0)
+        , handler_(std::move(handler))
     {
         #ifdef HTTP_CONNECTION_TRACE
         ++ connectionCount_;
         #endif
+        load_->connection_opened();
+        metrics_->connection_accepted();
+        if(tracer_->enabled())
+        {
+            trace_connection_ = tracer_->next_connection();
+            trace_accepted_ = tracer_->take_accepted();
+        }
+        asio::use_service<connection_list<basic_http_connection> >(socket_.get_executor().context()).insert(*this);
+        
+        // reuse the buffers of a connection closed on this worker
+        storage_ = asio::use_service<connection_pool<basic_http_connection> >(socket_.get_executor().context()).take();
+        if(storage_)
+        {
+            buffer_ = std::move(storage_->buffer_);
+            buffer_.max_size(limit);
+            pipeline_ = std::move(storage_->pipeline_);
+            window_ = std::move(storage_->window_);
+            write_buffers_ = std::move(storage_->write_buffers_);
+            batch_ = std::move(storage_->batch_);
+            read_memory_ = std::move(storage_->read_memory_);
+            write_memory_ = std::move(storage_->write_memory_);
+        }
+        pipeline_.resize(pipeline_size);
+    }
+    
+    /// A connection of http_function_handler.
+    explicit basic_http_connection(tcp::socket && sock, request_callback rc, close_callback cc, std::size_t pipeline_size, std::size_t limit = std::numeric_limits<std::size_t>::max())
+        : basic_http_connection(std::move(sock), Handler{rc, cc}, pipeline_size, limit)
+    {
     }
     
-    ~http_connection()
+    ~basic_http_connection()
     {
+        // a connection migrated away is no longer counted on its old worker
+        if(is_linked())
+        {
+            load_->request_finished(pipeline_.size());
+            load_->connection_closed();
+        }
         #ifdef HTTP_CONNECTION_TRACE
         --connectionCount_;
         #endif
+        
+        // keep the buffers warm for the next connection of this worker, the
+        // parsers may hold memory of the slots
+        parser_ = boost::none;
+        stream_parser_ = boost::none;
+        if(!storage_)
+            storage_.reset(new storage);
+        buffer_.clear();
+        pipeline_.clear();
+        write_buffers_.clear();
+        batch_.clear();
+        storage_->buffer_ = std::move(buffer_);
+        storage_->pipeline_ = std::move(pipeline_);
+        storage_->window_ = std::move(window_);
+        storage_->write_buffers_ = std::move(write_buffers_);
+        storage_->batch_ = std::move(batch_);
+        storage_->read_memory_ = std::move(read_memory_);
+        storage_->write_memory_ = std::move(write_memory_);
+        asio::use_service<connection_pool<basic_http_connection> >(socket_.get_executor().context()).give(std::move(storage_));
     }
     
     void start()
@@ -188,6 +673,11 @@ public:
         // Send a TCP shutdown
         error_code ec;
         socket_.shutdown(tcp::socket::shutdown_both, ec);
+        read_timer_.cancel();
+        write_timer_.cancel();
+        release_timer_.cancel();
+        abort_body();
+        abort_chunks();
         
         //auto self = shared_from_this();
         //socket_.get_io_context().post([this, self]()
@@ -196,6 +686,104 @@ public:
         //});
     }
     
+    /// Stop reading new requests, write the ones in the pipeline and close
+    /// the connection once it is empty, the last response with Connection:
+    /// close. A connection which has not served a request yet may still
+    /// read its first one.
+    void drain()
+    {
+        draining_ = true;
+        if(idle() && served_)
+            do_stop();
+    }
+    
+    /// Replace the callbacks, used by the worker adopting a migrated connection.
+    void rebind(request_callback rc, close_callback cc)
+    {
+        handler_ = Handler{rc, cc};
+    }
+    
+    void rebind(Handler handler)
+    {
+        handler_ = std::move(handler);
+    }
+    
+    /// Leave request bodies of at least min_size bytes with a Content-Length
+    /// in the read buffer instead of copying them, see context::request_body().
+    /// Reading pauses while such a body is held. Zero disables it.
+    void enable_body_view(std::size_t min_size)
+    {
+        body_view_size_ = min_size;
+    }
+    
+    /// Hand request bodies with a chunked encoding or a Content-Length of at
+    /// least min_size bytes to the handler in pieces of up to window bytes,
+    /// see context::read_body(). The request callback is called once the
+    /// header is read, such bodies have no size limit. Zero disables it.
+    void enable_body_stream(std::size_t min_size, std::size_t window = 64 * 1024)
+    {
+        stream_size_ = min_size;
+        window_size_ = window;
+    }
+    
+    /// Set the deadlines, kept on the timer wheel of the connection's io_context.
+    void set_timeouts(const timeouts & t)
+    {
+        timeouts_ = t;
+    }
+    
+    /// Free the read buffer, the body window and the pipeline slots of a
+    /// connection idle for after, the next request allocates them again.
+    /// Zero disables it.
+    void enable_idle_release(chrono::milliseconds after)
+    {
+        idle_release_ = after;
+    }
+    
+    /// Bytes held by the connection, without the socket and the messages'
+    /// fields allocated from the heap.
+    std::size_t memory_usage() const
+    {
+        return sizeof(*this) + buffer_.capacity() + window_.capacity() + write_buffers_.capacity() * sizeof(asio::const_buffer)
+            + read_memory_.capacity() + write_memory_.capacity() + pipeline_.memory_usage();
+    }
+    
+    /// Deliver requests in batches instead of one by one to the request callback.
+    void set_batch_request_callback(batch_request_callback bc)
+    {
+        batch_request_callback_ = bc;
+    }
+    
+    /// True while waiting for the next request with nothing buffered and
+    /// nothing in the pipeline.
+    bool idle()
+    {
+        return idle_ && pipeline_.size() == 0 && !stopped_ && migrate_target_ == nullptr;
+    }
+    
+    /// Move an idle connection to the target io_context, keeping its buffer
+    /// and pipeline. Must be called on the owning thread. The close callback
+    /// is invoked when the connection leaves this worker, then adopt is
+    /// called on the target io_context, it should rebind() and start() it.
+    bool migrate(asio::io_context & target, adopt_callback adopt)
+    {
+        if(!idle())
+            return false;
+        
+        migrate_target_ = &target;
+        adopt_callback_ = adopt;
+        
+        // the handle is released once the pending wait is aborted
+        error_code ec;
+        socket_.cancel(ec);
+        return true;
+    }
+    
+    tcp::socket::executor_type get_executor()
+    {
+        return socket_.get_executor();
+    }
+    
     tcp::endpoint local_endpoint()
     {
         tcp::endpoint ep;
@@ -213,96 +801,1175 @@ public:
     }
     
 private:
-    friend class http_context<shared_ptr<http_connection> >;
+    friend class http_context<shared_ptr<basic_http_connection> >;
+    
+    http_request & request(std::size_t index)
+    {
+        return pipeline_.at(index).request_;
+    }
     
     http_response & response(std::size_t index)
     {
-        return pipeline_.data_[index].response_;
+        return pipeline_.at(index).response_;
     }
     
-    bool commit(std::size_t index)
+    beast::string_view request_body(std::size_t index)
     {
-        if(stopped_)
-            return false;
-        
-        pipeline_.commit(index);
-        
-        // start write if index is first
-        if(index == pipeline_.first_)
-            do_write();
-        
-        return true;
+        auto & data = pipeline_.at(index);
+        if(data.pinned_)
+        {
+            return data.body_view_;
+        }
+        return beast::string_view(data.request_.body().data(), data.request_.body().size());
     }
     
-    void do_write()
+    void release_body(std::size_t index)
     {
-        // first index not ready or empty
-        if(!pipeline_.ready())
+        auto & data = pipeline_.at(index);
+        if(!data.pinned_)
         {
             return;
         }
         
-        auto self = shared_from_this();
-        http::async_write(socket_, pipeline_.front(), [this, self](const error_code & ec, std::size_t bytes)
+        unpin(data);
+        if(pinned_ == 0)
         {
-            if(stopped_)
-            {
-                return;
-            }
-            
-            if(ec || pipeline_.front().need_eof())
-            {
-                // This means we should close the connection, usually because
-                // the response indicated the "Connection: close" semantic.
-                return do_stop();
-            }
-            
-            // if pipeline is full, start read operation
-            if(pipeline_.full())
-            {
-                pipeline_.pop();
-                do_read();
-            }
-            else
-            {
-                pipeline_.pop();
-            }
-            
-            do_write();
-        });
+            post_read();
+        }
     }
     
-    void do_read()
+    /// Hands a piece of a body that needs no read to a body callback.
+    template<typename Callback>
+    struct body_delivery
     {
-        // Read a request
-        if(pipeline_.full())
+        context context_;
+        
+        Callback callback_;
+        
+        error_code ec_;
+        
+        beast::string_view body_;
+        
+        void operator()()
         {
-            return;
+            callback_(std::move(context_), ec_, body_);
+        }
+    };
+    
+    template<typename Callback>
+    void read_body(std::size_t index, context && ctx, Callback && cb)
+    {
+        auto & data = pipeline_.at(index);
+        if(data.streamed_ && !data.body_done_ && !stopped_)
+        {
+            body_context_.emplace(std::move(ctx));
+            body_callback_ = std::forward<Callback>(cb);
+            return post_read();
         }
         
-        std::size_t index = pipeline_.consume();
-        request_ = http_request{};
-        // read until pipeline is full
-        auto self = shared_from_this();
-        http::async_read(socket_, buffer_, request_, [this, self, index](const error_code & ec, std::size_t bytes)
+        error_code ec;
+        beast::string_view body;
+        if(stopped_)
+        {
+            ec = asio::error::connection_aborted;
+        }
+        else if(!data.body_done_)
+        {
+            // the whole body was read with the header
+            body = request_body(index);
+            data.body_done_ = true;
+        }
+        
+        typedef body_delivery<typename std::decay<Callback>::type> delivery;
+        asio::post(socket_.get_executor(), delivery{std::move(ctx), std::forward<Callback>(cb), ec, body});
+    }
+    
+    /// Continue reading outside of the callback which may have asked for it.
+    void post_read()
+    {
+        auto self = this->shared_from_this();
+        asio::post(socket_.get_executor(), [this, self]()
         {
-            if(stopped_)
-            {
-                return;
-            }
-            
-            if(ec)
-            {
-                return do_stop();
-            }
-            
-            pipeline_.push();
-            request_callback_(context{self, index}, request_);
             do_read();
         });
     }
     
-    void do_stop()
+    void deliver_body(const error_code & ec, beast::string_view body)
+    {
+        if(!body_context_)
+        {
+            return;
+        }
+        
+        context ctx(std::move(*body_context_));
+        body_context_ = boost::none;
+        body_callback cb = std::move(body_callback_);
+        body_callback_ = nullptr;
+        cb(std::move(ctx), ec, body);
+    }
+    
+    /// Tell a handler waiting for its body that none will come.
+    void abort_body()
+    {
+        deliver_body(asio::error::connection_aborted, beast::string_view());
+    }
+    
+    void set_response_body(std::size_t index, beast::string_view body)
+    {
+        auto & data = pipeline_.at(index);
+        data.response_view_ = body;
+        data.response_.body().clear();
+        data.response_.content_length(body.size());
+    }
+    
+    bool set_response_file(std::size_t index, const char * path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+            return false;
+        
+        struct stat st;
+        if(::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(fd);
+            return false;
+        }
+        
+        auto & data = pipeline_.at(index);
+        http_response & response = data.response_;
+        std::uint64_t size = st.st_size;
+        std::uint64_t first = 0;
+        std::uint64_t last = size - 1;
+        http_range_result range = range_none;
+        auto iter = data.request_.find(http::field::range);
+        if(iter != data.request_.end())
+            range = parse_range(iter->value(), size, first, last);
+        
+        response.set(http::field::accept_ranges, "bytes");
+        if(range == range_unsatisfiable)
+        {
+            ::close(fd);
+            response.result(http::status::range_not_satisfiable);
+            response.set(http::field::content_range, "bytes */" + std::to_string(size));
+            set_response_body(index, beast::string_view());
+            return true;
+        }
+        
+        if(range == range_ok)
+        {
+            response.result(http::status::partial_content);
+            response.set(http::field::content_range, "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size));
+        }
+        else
+        {
+            response.result(http::status::ok);
+        }
+        
+        set_response_file(index, fd, first, size == 0 ? 0 : last - first + 1);
+        return true;
+    }
+    
+    void set_response_file(std::size_t index, int fd, std::uint64_t offset, std::uint64_t size)
+    {
+        auto & data = pipeline_.at(index);
+        set_response_body(index, beast::string_view());
+        data.response_.content_length(size);
+        data.close_file();
+        
+        // a HEAD response has the length but no body
+        if(data.request_.method() == http::verb::head || size == 0)
+        {
+            ::close(fd);
+            return;
+        }
+        
+        data.file_ = fd;
+        data.file_offset_ = offset;
+        data.file_size_ = size;
+        ignore_sigpipe();
+    }
+    
+    /// sendfile() has no MSG_NOSIGNAL, a peer closing the connection would
+    /// kill the process. A handler installed by the application is kept.
+    static void ignore_sigpipe()
+    {
+        static bool ignored = []()
+        {
+            struct sigaction sa;
+            if(::sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL)
+                ::signal(SIGPIPE, SIG_IGN);
+            return true;
+        }();
+        (void)ignored;
+    }
+    
+    void unpin(pipeline_data & data)
+    {
+        data.pinned_ = false;
+        data.body_view_ = beast::string_view();
+        --pinned_;
+    }
+    
+    bool commit(std::size_t index)
+    {
+        if(stopped_)
+            return false;
+        
+        // begin() committed a chunked response already, it ends with the last chunk
+        if(pipeline_.at(index).chunked_)
+            return finish(index);
+        
+        committed(pipeline_.at(index));
+        pipeline_.commit(index);
+        
+        // start write if index is first
+        if(index == pipeline_.first_)
+            do_write();
+        
+        return true;
+    }
+    
+    void committed(pipeline_data & data)
+    {
+        data.committed_ = chrono::steady_clock::now();
+        data.trace_.mark(trace_committed);
+        metrics_->request_committed(data.committed_ - data.queued_);
+    }
+    
+    bool begin(std::size_t index)
+    {
+        if(stopped_)
+            return false;
+        
+        auto & data = pipeline_.at(index);
+        if(data.chunked_)
+            return true;
+        
+        if(data.file_ != -1)
+            return false;
+        
+        data.chunked_ = true;
+        // no chunks for an HTTP/1.0 client, whatever version the handler set
+        if(data.request_.version() < 11 || data.response_.version() < 11)
+        {
+            data.response_.content_length(boost::none);
+            data.response_.keep_alive(false);
+        }
+        else
+        {
+            data.response_.chunked(true);
+        }
+        
+        // the body set before goes out first, from where it is
+        if(data.response_view_.empty() && data.response_.body().size() != 0)
+            data.response_view_ = beast::string_view(data.response_.body().data(), data.response_.body().size());
+        committed(data);
+        pipeline_.commit(index);
+        do_write();
+        return true;
+    }
+    
+    /// Hands a written chunk's context back to its producer.
+    template<typename Callback>
+    struct chunk_delivery
+    {
+        context context_;
+        
+        Callback callback_;
+        
+        error_code ec_;
+        
+        void operator()()
+        {
+            callback_(std::move(context_), ec_);
+        }
+    };
+    
+    template<typename Callback>
+    void write_chunk(std::size_t index, context && ctx, beast::string_view chunk, Callback && cb)
+    {
+        typedef chunk_delivery<typename std::decay<Callback>::type> delivery;
+        auto & data = pipeline_.at(index);
+        if(stopped_ || data.finished_)
+        {
+            asio::post(socket_.get_executor(), delivery{std::move(ctx), std::forward<Callback>(cb), asio::error::connection_aborted});
+            return;
+        }
+        
+        if(!begin(index))
+        {
+            asio::post(socket_.get_executor(), delivery{std::move(ctx), std::forward<Callback>(cb), asio::error::operation_not_supported});
+            return;
+        }
+        
+        // an empty chunk would end the response
+        if(chunk.empty())
+        {
+            asio::post(socket_.get_executor(), delivery{std::move(ctx), std::forward<Callback>(cb), error_code()});
+            return;
+        }
+        
+        data.chunk_ = chunk;
+        data.chunk_context_.emplace(std::move(ctx));
+        data.chunk_callback_ = std::forward<Callback>(cb);
+        do_write();
+    }
+    
+    bool finish(std::size_t index)
+    {
+        if(!begin(index))
+            return false;
+        
+        pipeline_.at(index).finished_ = true;
+        do_write();
+        return true;
+    }
+    
+    /// Hand the context of a chunk back to its producer, outside of the
+    /// write path the producer may call again.
+    void deliver_chunk(pipeline_data & data, const error_code & ec)
+    {
+        typedef chunk_delivery<chunk_callback> delivery;
+        context ctx(std::move(*data.chunk_context_));
+        data.chunk_context_ = boost::none;
+        data.chunk_ = beast::string_view();
+        asio::post(socket_.get_executor(), delivery{std::move(ctx), std::move(data.chunk_callback_), ec});
+        data.chunk_callback_ = nullptr;
+    }
+    
+    /// Tell the producers of chunks that were not written yet.
+    void abort_chunks()
+    {
+        for(std::size_t i = pipeline_.first_; i != pipeline_.last_; i = pipeline_.next(i))
+        {
+            auto & data = pipeline_.at(i);
+            if(data.chunk_context_)
+                deliver_chunk(data, asio::error::connection_aborted);
+        }
+    }
+    
+    /// Add the parts of a chunked response that are ready to the write,
+    /// false if there are none.
+    bool gather_chunks(pipeline_data & data)
+    {
+        std::size_t size = write_buffers_.size();
+        data.size_ = 0;
+        
+        // the header goes first, the serializer writes nothing else
+        if(!data.serializer_)
+        {
+            data.serializer_.emplace(data.response_);
+            data.serializer_->split(true);
+        }
+        if(!data.serializer_->is_header_done())
+        {
+            error_code ec;
+            data.serializer_->next(ec, gather_buffers{write_buffers_, data.size_});
+            
+            // the body set before begin()
+            if(!data.response_view_.empty())
+                gather_chunk(data, data.response_view_, data.response_header_);
+            data.response_view_ = beast::string_view();
+        }
+        
+        if(data.chunk_context_)
+        {
+            gather_chunk(data, data.chunk_, data.chunk_header_);
+            data.chunk_sent_ = true;
+        }
+        else if(data.finished_)
+        {
+            // an HTTP/1.0 body ends with the connection
+            if(data.response_.chunked())
+                write_buffers_.push_back(asio::buffer("0\r\n\r\n", 5));
+            data.last_sent_ = true;
+            return true;
+        }
+        
+        return write_buffers_.size() != size;
+    }
+    
+    /// Add piece to the write, framed as a chunk unless the body ends with
+    /// the connection. header holds the chunk-size line.
+    void gather_chunk(pipeline_data & data, beast::string_view piece, char (&header)[20])
+    {
+        if(!data.response_.chunked())
+        {
+            write_buffers_.push_back(asio::buffer(piece.data(), piece.size()));
+            return;
+        }
+        
+        // chunk-size in hex, CRLF, data, CRLF
+        char * p = header + sizeof(header);
+        *--p = '\n';
+        *--p = '\r';
+        std::size_t n = piece.size();
+        do
+        {
+            *--p = "0123456789abcdef"[n & 0xf];
+            n >>= 4;
+        }
+        while(n != 0);
+        
+        write_buffers_.push_back(asio::buffer(p, header + sizeof(header) - p));
+        write_buffers_.push_back(asio::buffer(piece.data(), piece.size()));
+        write_buffers_.push_back(asio::buffer("\r\n", 2));
+    }
+    
+    /// Appends the buffers a serializer produces to a scatter/gather list.
+    struct gather_buffers
+    {
+        std::vector<asio::const_buffer> & buffers_;
+        
+        std::size_t & size_;
+        
+        template<typename ConstBufferSequence>
+        void operator()(error_code &, const ConstBufferSequence & buffers)
+        {
+            for(auto i = asio::buffer_sequence_begin(buffers); i != asio::buffer_sequence_end(buffers); ++i)
+            {
+                asio::const_buffer b = *i;
+                buffers_.push_back(b);
+                size_ += b.size();
+            }
+        }
+    };
+    
+    void do_write()
+    {
+        // first index not ready or empty, or a write in flight
+        if(!pipeline_.ready() || writing_)
+        {
+            return;
+        }
+        
+        // gather every consecutive ready response into a single writev
+        write_buffers_.clear();
+        std::size_t count = 0;
+        for(std::size_t i = pipeline_.first_; i != pipeline_.last_ && pipeline_.at(i).ready_; i = pipeline_.next(i))
+        {
+            auto & data = pipeline_.at(i);
+            
+            // the last response of a draining connection tells the client it closes
+            if(!data.serializer_ && data.response_.keep_alive() && drained() && pipeline_.next(i) == pipeline_.last_)
+            {
+                data.response_.keep_alive(false);
+                if(!data.preserialized_.empty())
+                    data.preserialized_ = admission_control::overloaded_response(false);
+            }
+            
+            // a chunked response waits for its producer, after it the next
+            // response may follow in the same write
+            if(data.chunked_)
+            {
+                if(!gather_chunks(data))
+                    break;
+                data.trace_.mark_once(trace_write_started);
+                ++count;
+                if(!data.last_sent_ || data.response_.need_eof())
+                    break;
+                continue;
+            }
+            
+            if(!data.preserialized_.empty())
+            {
+                write_buffers_.push_back(asio::buffer(data.preserialized_.data(), data.preserialized_.size()));
+                ++count;
+                if(data.response_.need_eof())
+                    break;
+                continue;
+            }
+            
+            bool first = !data.serializer_;
+            if(first)
+            {
+                data.serializer_.emplace(data.response_);
+                data.trace_.mark(trace_write_started);
+            }
+            
+            error_code ec;
+            data.size_ = 0;
+            data.serializer_->next(ec, gather_buffers{write_buffers_, data.size_});
+            if(ec)
+            {
+                return do_stop();
+            }
+            ++count;
+            
+            // the first buffers hold the header, the body view follows it
+            if(first && !data.response_view_.empty())
+                write_buffers_.push_back(asio::buffer(data.response_view_.data(), data.response_view_.size()));
+            
+            // the file follows the header with sendfile()
+            if(data.file_ != -1)
+                break;
+            
+            // a chunked response may take more than one write, and nothing
+            // is written after a response closing the connection
+            if(data.response_.chunked() || data.response_.need_eof())
+                break;
+        }
+        
+        if(count == 0)
+        {
+            return;
+        }
+        
+        writing_ = true;
+        arm_write();
+        auto self = this->shared_from_this();
+        asio::async_write(socket_, write_buffers_, make_custom_alloc_handler(write_memory_, [this, self, count](const error_code & ec, std::size_t bytes)
+        {
+            writing_ = false;
+            write_timer_.cancel();
+            if(stopped_)
+            {
+                return;
+            }
+            
+            if(ec)
+            {
+                return do_stop();
+            }
+            
+            metrics_->bytes_written(bytes);
+            for(std::size_t n = 0; n < count; ++n)
+            {
+                auto & data = pipeline_.at(pipeline_.first_);
+                if(data.chunked_)
+                {
+                    // only the first write holds the header
+                    if(data.size_ != 0)
+                        data.serializer_->consume(data.size_);
+                    data.size_ = 0;
+                    if(data.chunk_sent_)
+                    {
+                        data.chunk_sent_ = false;
+                        deliver_chunk(data, error_code());
+                    }
+                    if(!data.last_sent_)
+                        break;
+                }
+                else if(data.preserialized_.empty())
+                {
+                    data.serializer_->consume(data.size_);
+                    if(!data.serializer_->is_done())
+                        break;
+                    
+                    // the header of a file response is written, the file is the last of this write
+                    if(data.file_ != -1)
+                        return send_file();
+                }
+                
+                if(!pop_response())
+                    return;
+            }
+            
+            write_done();
+        }));
+    }
+    
+    /// Send the rest of the file of the first response straight from the
+    /// page cache to the socket, waiting while its send buffer is full.
+    void send_file()
+    {
+        auto & data = pipeline_.at(pipeline_.first_);
+        error_code ec;
+        socket_.native_non_blocking(true, ec);
+        while(data.file_size_ != 0)
+        {
+            off_t offset = data.file_offset_;
+            std::size_t size = std::min<std::uint64_t>(data.file_size_, 0x7ffff000);
+            ssize_t n = ::sendfile(socket_.native_handle(), data.file_, &offset, size);
+            if(n > 0)
+            {
+                metrics_->bytes_written(n);
+                data.file_offset_ += n;
+                data.file_size_ -= n;
+                continue;
+            }
+            
+            if(n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                writing_ = true;
+                arm_write();
+                auto self = this->shared_from_this();
+                socket_.async_wait(tcp::socket::wait_write, make_custom_alloc_handler(write_memory_, [this, self](const error_code & ec)
+                {
+                    writing_ = false;
+                    write_timer_.cancel();
+                    if(stopped_)
+                    {
+                        return;
+                    }
+                    
+                    if(ec)
+                    {
+                        return do_stop();
+                    }
+                    
+                    send_file();
+                }));
+                return;
+            }
+            
+            // an error, or the file is shorter than the Content-Length sent
+            return do_stop();
+        }
+        
+        data.close_file();
+        if(pop_response())
+            write_done();
+    }
+    
+    /// The first response is written, false if the connection stopped.
+    bool pop_response()
+    {
+        auto & data = pipeline_.at(pipeline_.first_);
+        if(data.response_.need_eof())
+        {
+            // This means we should close the connection, usually because
+            // the response indicated the "Connection: close" semantic.
+            do_stop();
+            return false;
+        }
+        
+        if(data.pinned_)
+            unpin(data);
+        metrics_->response_flushed(chrono::steady_clock::now() - data.committed_);
+        if(data.trace_.sampled())
+        {
+            data.trace_.mark(trace_write_completed);
+            tracer_->emit(trace_connection_, data.trace_);
+        }
+        pipeline_.pop();
+        load_->request_finished();
+        served_ = true;
+        return true;
+    }
+    
+    void write_done()
+    {
+        if(draining_ && pipeline_.size() == 0)
+        {
+            return do_stop();
+        }
+        
+        if(idle_ && pipeline_.size() == 0)
+        {
+            arm_idle();
+        }
+        
+        // write first, requests dispatched by do_read() may commit at once
+        do_write();
+        
+        // resume reading if the pipeline was full or the buffer pinned
+        do_read();
+    }
+    
+    bool can_read()
+    {
+        if(stopped_)
+        {
+            return false;
+        }
+        
+        // a streamed body is read whenever the handler asks for it
+        if(stream_parser_)
+        {
+            return static_cast<bool>(body_context_);
+        }
+        
+        return !pipeline_.full() && !drained();
+    }
+    
+    /// Draining and no more requests are read, the last one in the pipeline
+    /// is the last the connection answers.
+    bool drained()
+    {
+        return draining_ && (served_ || pipeline_.size() != 0);
+    }
+    
+    /// Parse and dispatch what is buffered, then read more if there is
+    /// room. Does nothing while a read is in flight.
+    void do_read()
+    {
+        if(reading_)
+        {
+            return;
+        }
+        
+        // requests already complete in the buffer need no read, a handler
+        // may ask for its streamed body which is buffered already
+        do
+        {
+            parse_buffered();
+        }
+        while(dispatch());
+        
+        // Read a request, a connection not reading can't be too slow
+        if(!can_read())
+        {
+            return cancel_read();
+        }
+        
+        // the bytes of body views must not move in buffer_
+        if(pinned_ != 0)
+        {
+            return cancel_read();
+        }
+        
+        // nothing of the next request has arrived yet
+        if(buffer_.size() == 0 && !parser_ && !stream_parser_)
+        {
+            // a wait leaves buffer_ alone for release_memory() to free
+            if(idle_release_.count() != 0)
+            {
+                return do_wait();
+            }
+            
+            // a read aborted by migrate() moves nothing out of the socket
+            idle_ = true;
+            if(pipeline_.size() == 0)
+                arm_read(phase_idle);
+            else
+                cancel_read();
+            return do_read_request();
+        }
+        
+        arm_read((parser_ && parser_->is_header_done()) || stream_parser_ ? phase_body : phase_header);
+        do_read_request();
+    }
+    
+    void do_wait()
+    {
+        // Wait for the next request without reading, until then no partial
+        // request is held by a parser
+        idle_ = true;
+        reading_ = true;
+        
+        // the idle deadline starts once the responses are written
+        if(pipeline_.size() == 0)
+            arm_idle();
+        else
+            cancel_read();
+        auto self = this->shared_from_this();
+        socket_.async_wait(tcp::socket::wait_read, make_custom_alloc_handler(read_memory_, [this, self](const error_code & ec)
+        {
+            idle_ = false;
+            reading_ = false;
+            release_timer_.cancel();
+            
+            if(stopped_)
+            {
+                return;
+            }
+            
+            if(migrate_target_)
+            {
+                return do_migrate();
+            }
+            
+            if(ec)
+            {
+                return do_stop();
+            }
+            
+            // closed by do_write() once the pipeline is empty
+            if(draining_ && served_)
+            {
+                return;
+            }
+            
+            arm_read(phase_header);
+            do_read_request();
+        }));
+    }
+    
+    void do_read_request()
+    {
+        // a header larger than the buffer limit leaves no room to read
+        std::size_t size = beast::read_size(buffer_, 65536);
+        if(size == 0)
+        {
+            return do_stop();
+        }
+        
+        reading_ = true;
+        auto self = this->shared_from_this();
+        socket_.async_read_some(buffer_.prepare(size), make_custom_alloc_handler(read_memory_, [this, self](const error_code & ec, std::size_t bytes)
+        {
+            idle_ = false;
+            reading_ = false;
+            if(stopped_)
+            {
+                return;
+            }
+            
+            if(!ec)
+            {
+                metrics_->bytes_read(bytes);
+                buffer_.commit(bytes);
+            }
+            
+            // what was read before the cancel moves along in buffer_
+            if(migrate_target_ && (!ec || ec == asio::error::operation_aborted))
+            {
+                return do_migrate();
+            }
+            
+            if(ec)
+            {
+                return do_stop();
+            }
+            
+            do_read();
+        }));
+    }
+    
+    /// Parse buffer_ into the free slots of the pipeline without reading.
+    /// The parser keeps a partial request until the rest is read, its
+    /// message is allocated in the slot it is read into.
+    void parse_buffered()
+    {
+        while(can_read())
+        {
+            if(stream_parser_)
+            {
+                if(!feed_stream())
+                {
+                    return;
+                }
+                continue;
+            }
+            
+            std::size_t index = pipeline_.consume();
+            
+            // the header is parsed, decide where the body goes
+            if(parser_ && parser_->is_header_done() && !parser_->eager())
+            {
+                if(!route_body(index))
+                {
+                    return;
+                }
+                continue;
+            }
+            
+            if(buffer_.size() == 0)
+            {
+                return;
+            }
+            
+            if(!parser_)
+            {
+                // the header deadline of the new request starts with its next read
+                read_phase_ = phase_none;
+                parser_.emplace(make_message<http_request>(pipeline_.at(index).arena_));
+                pipeline_.at(index).trace_.start(tracer_->sample(), trace_accepted_);
+                trace_accepted_ = 0;
+                // a streamed body has no limit, the others get one after the header
+                parser_->body_limit(stream_size_ != 0 ? std::numeric_limits<std::uint64_t>::max() : body_limit);
+                // stop after the header to decide where the body goes
+                parser_->eager(body_view_size_ == 0 && stream_size_ == 0);
+            }
+            
+            error_code ec;
+            std::size_t bytes = parser_->put(buffer_.data(), ec);
+            buffer_.consume(bytes);
+            if(parser_->is_header_done())
+                pipeline_.at(index).trace_.mark_once(trace_header_parsed);
+            if(ec == http::error::need_more)
+            {
+                return;
+            }
+            
+            if(ec)
+            {
+                return do_stop();
+            }
+            
+            if(!parser_->is_done())
+            {
+                if(bytes == 0)
+                {
+                    return;
+                }
+                continue;
+            }
+            
+            pipeline_.at(index).request_ = parser_->release();
+            parser_ = boost::none;
+            push_request(index);
+        }
+    }
+    
+    /// Called once the header of a request with a body is parsed. Streams
+    /// the body, leaves it in buffer_ as a view, or lets the parser copy it.
+    /// Returns false while a view is not completely buffered.
+    bool route_body(std::size_t index)
+    {
+        auto length = parser_->content_length();
+        if(stream_size_ != 0 && (!length || *length >= stream_size_))
+        {
+            start_stream(index);
+            return true;
+        }
+        
+        if(length && *length > body_limit)
+        {
+            do_stop();
+            return false;
+        }
+        parser_->body_limit(body_limit);
+        
+        if(body_view_size_ == 0 || !length || *length < body_view_size_ || *length > buffer_.max_size())
+        {
+            parser_->eager(true);
+            return true;
+        }
+        
+        if(buffer_.size() < *length)
+        {
+            return false;
+        }
+        
+        auto & data = pipeline_.at(index);
+        data.request_ = parser_->release();
+        parser_ = boost::none;
+        data.body_view_ = beast::string_view(static_cast<const char *>(buffer_.data().data()), *length);
+        data.pinned_ = true;
+        ++pinned_;
+        buffer_.consume(*length);
+        push_request(index);
+        return true;
+    }
+    
+    /// Dispatch the header, the body follows through read_body().
+    void start_stream(std::size_t index)
+    {
+        stream_parser_.emplace(std::move(*parser_));
+        stream_parser_->eager(true);
+        parser_ = boost::none;
+        window_.resize(window_size_);
+        
+        auto & data = pipeline_.at(index);
+        data.request_.base() = std::move(stream_parser_->get().base());
+        data.streamed_ = true;
+        stream_index_ = index;
+        push_request(index);
+    }
+    
+    /// Parse the streamed body into window_ for the waiting body callback.
+    /// Returns false when more has to be read first.
+    bool feed_stream()
+    {
+        auto & body = stream_parser_->get().body();
+        body.data = window_.data();
+        body.size = window_.size();
+        
+        error_code ec;
+        while(buffer_.size() != 0 && body.size != 0 && !stream_parser_->is_done())
+        {
+            std::size_t bytes = stream_parser_->put(buffer_.data(), ec);
+            buffer_.consume(bytes);
+            if(ec == http::error::need_buffer || ec == http::error::need_more)
+            {
+                ec = {};
+                break;
+            }
+            
+            if(ec || bytes == 0)
+            {
+                break;
+            }
+        }
+        
+        if(ec)
+        {
+            deliver_body(ec, beast::string_view());
+            do_stop();
+            return false;
+        }
+        
+        std::size_t size = window_.size() - body.size;
+        bool done = stream_parser_->is_done();
+        if(size == 0 && !done)
+        {
+            return false;
+        }
+        
+        if(done)
+        {
+            pipeline_.at(stream_index_).body_done_ = true;
+            pipeline_.at(stream_index_).trace_.mark(trace_body_complete);
+            stream_parser_ = boost::none;
+        }
+        deliver_body(error_code(), beast::string_view(window_.data(), size));
+        return true;
+    }
+    
+    void push_request(std::size_t index)
+    {
+        auto & data = pipeline_.at(index);
+        data.queued_ = chrono::steady_clock::now();
+        if(!data.streamed_)
+            data.trace_.mark(trace_body_complete);
+        pipeline_.push();
+        load_->request_started();
+        metrics_->request_queued(pipeline_.size());
+        batch_.push_back(index);
+    }
+    
+    /// Answer a request for the metrics mounted on this worker, see
+    /// worker_metrics::mount(), false if it is for the handler. A streamed
+    /// body is already on its way to the handler, its request is too.
+    bool serve_builtin(std::size_t index)
+    {
+        auto & data = pipeline_.at(index);
+        if(data.streamed_)
+            return false;
+        
+        const metrics_registry * registry = metrics_->mounted(data.request_.target());
+        if(registry == nullptr)
+            return false;
+        
+        std::string text = registry->prometheus();
+        data.response_.version(data.request_.version());
+        data.response_.result(http::status::ok);
+        data.response_.set(http::field::content_type, "text/plain; version=0.0.4");
+        data.response_.keep_alive(data.request_.keep_alive());
+        data.response_.body().assign(text.data(), text.size());
+        data.response_.prepare_payload();
+        commit(index);
+        return true;
+    }
+    
+    /// Answer a request the worker does not admit with the 503 of
+    /// admission_control, false if it is for the handler. later requests of
+    /// the batch were read after it. A streamed body is already on its way
+    /// to the handler.
+    bool shed(std::size_t index, std::size_t later)
+    {
+        auto & data = pipeline_.at(index);
+        if(data.streamed_ || admission_->admit_request(later))
+            return false;
+        
+        // response_ only decides whether the connection closes after it
+        data.response_.keep_alive(data.request_.keep_alive());
+        data.response_.content_length(0);
+        data.preserialized_ = admission_control::overloaded_response(data.request_.keep_alive());
+        commit(index);
+        return true;
+    }
+    
+    /// Hand the requests read to the callbacks, false if there were none.
+    bool dispatch()
+    {
+        if(batch_.empty())
+        {
+            return false;
+        }
+        
+        auto self = this->shared_from_this();
+        if(batch_request_callback_)
+        {
+            for(std::size_t i = 0; i < batch_.size(); ++i)
+            {
+                std::size_t index = batch_[i];
+                pipeline_.at(index).trace_.mark(trace_handler_invoked);
+                if(!serve_builtin(index) && !shed(index, batch_.size() - i - 1))
+                    batch_entries_.push_back(batch_entry{context{self, index}, pipeline_.at(index).request_});
+            }
+            batch_.clear();
+            monitor_->running("batch_request_callback");
+            batch_request_callback_(batch_entries_);
+            monitor_->running(nullptr);
+            batch_entries_.clear();
+            return true;
+        }
+        
+        for(std::size_t i = 0; i < batch_.size() && !stopped_; ++i)
+        {
+            std::size_t index = batch_[i];
+            pipeline_.at(index).trace_.mark(trace_handler_invoked);
+            if(serve_builtin(index) || shed(index, batch_.size() - i - 1))
+                continue;
+            monitor_->running("handle_request", pipeline_.at(index).request_.target());
+            handler_.handle_request(context{self, index}, pipeline_.at(index).request_);
+        }
+        monitor_->running(nullptr);
+        batch_.clear();
+        return true;
+    }
+    
+    void arm_read(read_phase phase)
+    {
+        // a header must arrive in time from its first read, a body between reads
+        if(phase == read_phase_ && phase != phase_body)
+        {
+            return;
+        }
+        
+        read_phase_ = phase;
+        chrono::milliseconds timeout = timeouts_.idle_;
+        if(phase == phase_header)
+            timeout = timeouts_.header_;
+        else if(phase == phase_body)
+            timeout = timeouts_.body_;
+        
+        if(timeout.count() == 0)
+            read_timer_.cancel();
+        else
+            timers_->arm(read_timer_, timeout);
+    }
+    
+    void arm_idle()
+    {
+        arm_read(phase_idle);
+        if(idle_release_.count() != 0)
+            timers_->arm(release_timer_, idle_release_);
+    }
+    
+    /// Free what an idle connection only needs for its next request, a
+    /// wait for it is in flight and reads nothing.
+    void release_memory()
+    {
+        if(!idle_ || pipeline_.size() != 0 || buffer_.size() != 0)
+        {
+            return;
+        }
+        
+        buffer_.shrink_to_fit();
+        std::vector<char>().swap(window_);
+        std::vector<asio::const_buffer>().swap(write_buffers_);
+        write_memory_.release();
+        pipeline_.shrink();
+    }
+    
+    void cancel_read()
+    {
+        read_phase_ = phase_none;
+        read_timer_.cancel();
+    }
+    
+    void arm_write()
+    {
+        if(timeouts_.write_.count() != 0)
+            timers_->arm(write_timer_, timeouts_.write_);
+    }
+    
+    void handle_timeout()
+    {
+        auto self = this->shared_from_this();
+        do_stop();
+    }
+    
+    void do_stop()
     {
         if(stopped_)
             return;
@@ -311,30 +1978,197 @@ private:
         // Send a TCP shutdown
         error_code ec;
         socket_.shutdown(tcp::socket::shutdown_both, ec);
+        read_timer_.cancel();
+        write_timer_.cancel();
+        release_timer_.cancel();
+        abort_body();
+        abort_chunks();
         
-        close_callback_(shared_from_this());
+        handler_.handle_close(this->shared_from_this());
         
         // At this point the connection is closed gracefully
     }
     
+    void do_migrate()
+    {
+        auto self = this->shared_from_this();
+        asio::io_context & source = static_cast<asio::io_context &>(socket_.get_executor().context());
+        asio::io_context & target = *migrate_target_;
+        adopt_callback adopt = std::move(adopt_callback_);
+        migrate_target_ = nullptr;
+        adopt_callback_ = nullptr;
+        
+        error_code ec;
+        tcp protocol = socket_.local_endpoint(ec).protocol();
+        if(ec)
+        {
+            return do_stop();
+        }
+        
+        tcp::socket::native_handle_type handle = socket_.release(ec);
+        if(ec)
+        {
+            return do_stop();
+        }
+        
+        // leave this worker
+        read_timer_.cancel();
+        release_timer_.cancel();
+        unlink();
+        load_->connection_closed();
+        handler_.handle_close(self);
+        
+        asio::post(target, [self, &source, &target, protocol, handle, adopt]() mutable
+        {
+            if(self->attach(target, protocol, handle))
+                return adopt(self);
+            
+            // still bound to the worker it left, its storage and timers
+            // must be released there by the last reference
+            auto destroy = [self]() {};
+            self.reset();
+            asio::post(source, std::move(destroy));
+        });
+    }
+    
+    /// Bind to context, on its thread. On failure the connection is left
+    /// as it was on the worker it left.
+    bool attach(asio::io_context & context, tcp protocol, tcp::socket::native_handle_type handle)
+    {
+        tcp::socket sock(context);
+        error_code ec;
+        sock.assign(protocol, handle, ec);
+        if(ec)
+        {
+            ::close(handle);
+            stopped_ = true;
+            return false;
+        }
+        
+        socket_ = std::move(sock);
+        load_ = &asio::use_service<worker_load>(context);
+        metrics_ = &asio::use_service<worker_metrics>(context);
+        tracer_ = &asio::use_service<request_tracer>(context);
+        monitor_ = &asio::use_service<loop_monitor>(context);
+        admission_ = &asio::use_service<admission_control>(context);
+        timers_ = &asio::use_service<timer_wheel>(context);
+        load_->connection_opened();
+        asio::use_service<connection_list<basic_http_connection> >(context).insert(*this);
+        return true;
+    }
+    
     tcp::socket socket_;
     
+    worker_load * load_;
+    
+    worker_metrics * metrics_;
+    
+    request_tracer * tracer_;
+    
+    /// Told which request callback runs, for the stall reports of its worker.
+    loop_monitor * monitor_;
+    
+    admission_control * admission_;
+    
+    /// Number of this connection in the traces of its worker.
+    std::uint32_t trace_connection_;
+    
+    /// When this connection was accepted, until its first request starts.
+    std::uint64_t trace_accepted_;
+    
+    timer_wheel * timers_;
+    
+    timeouts timeouts_;
+    
+    /// The deadline read_timer_ is armed for.
+    read_phase read_phase_;
+    
+    timer_wheel::timer read_timer_;
+    
+    timer_wheel::timer write_timer_;
+    
+    /// Idle time after which memory is released, zero for never.
+    chrono::milliseconds idle_release_;
+    
+    timer_wheel::timer release_timer_;
+    
     bool stopped_;
     
-    beast::flat_buffer buffer_;
+    bool idle_;
+    
+    bool draining_;
     
-    http_request request_;
+    bool served_;
+    
+    /// A wait or read is in flight on buffer_.
+    bool reading_;
+    
+    /// A write is in flight.
+    bool writing_;
+    
+    asio::io_context * migrate_target_;
+    
+    adopt_callback adopt_callback_;
+    
+    beast::flat_buffer buffer_;
     
     http_pipeline pipeline_;
     
-    request_callback request_callback_;
+    /// Parser of the request being read, into the slot at pipeline_.consume().
+    boost::optional<request_parser> parser_;
+    
+    /// Smallest body left in buffer_ as a view, zero for none.
+    std::size_t body_view_size_;
+    
+    /// Slots holding a body view.
+    std::size_t pinned_;
     
-    close_callback close_callback_;
+    /// Smallest body streamed, zero for none.
+    std::size_t stream_size_;
+    
+    std::size_t window_size_;
+    
+    /// Parser of the body streamed into window_ for the slot stream_index_.
+    boost::optional<stream_parser> stream_parser_;
+    
+    std::size_t stream_index_;
+    
+    std::vector<char> window_;
+    
+    /// The handler waiting for the next piece of a body.
+    boost::optional<context> body_context_;
+    
+    body_callback body_callback_;
+    
+    std::vector<asio::const_buffer> write_buffers_;
+    
+    /// Memory of the operations in flight, reused by every request.
+    handler_memory read_memory_;
+    
+    handler_memory write_memory_;
+    
+    /// Box of the buffers handed to the connection_pool when destroyed.
+    std::unique_ptr<storage> storage_;
+    
+    Handler handler_;
+    
+    batch_request_callback batch_request_callback_;
+    
+    /// Slots of the requests read but not dispatched yet.
+    std::vector<std::size_t> batch_;
+    
+    std::vector<batch_entry> batch_entries_;
 };
 
+typedef basic_http_connection<http_function_handler> http_connection;
+
 typedef shared_ptr<http_connection> http_connection_ptr;
 
+template<typename Handler>
+const std::uint64_t basic_http_connection<Handler>::body_limit;
+
 #ifdef HTTP_CONNECTION_TRACE
-uint64_t http_connection::connectionCount_;
+template<typename Handler>
+uint64_t basic_http_connection<Handler>::connectionCount_;
 #endif
 
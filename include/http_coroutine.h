@@ -0,0 +1,238 @@
+#pragma once
+
+#include <exception>
+#include <functional>
+#include <type_traits>
+
+#include <asio.h>
+#include <coroutine_frame_pool.h>
+#include <http_connection.h>
+
+#if !defined(BOOST_ASIO_HAS_CO_AWAIT)
+#error "http_coroutine.h requires C++20 coroutines"
+#endif
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+/// Completion of a request coroutine spawned by co_spawn_request(), the
+/// coroutine_frame_pool its entry frame comes from.
+struct request_completion
+{
+    void operator()(std::exception_ptr)
+    {
+    }
+
+    coroutine_frame_pool * pool_;
+};
+
+/// The coroutine_frame_pool of the first argument telling it.
+template<typename... Args>
+coroutine_frame_pool & frame_pool_of(coroutine_frame_pool & pool, Args &...)
+{
+    return pool;
+}
+
+template<typename... Args>
+coroutine_frame_pool & frame_pool_of(request_completion & completion, Args &...)
+{
+    return *completion.pool_;
+}
+
+template<typename ConnectionPtr, typename... Args>
+coroutine_frame_pool & frame_pool_of(http_context<ConnectionPtr> & ctx, Args &...)
+{
+    return asio::use_service<coroutine_frame_pool>(ctx.connection()->get_executor().context());
+}
+
+template<typename First, typename... Args>
+coroutine_frame_pool & frame_pool_of(First &, Args &... args)
+{
+    return frame_pool_of(args...);
+}
+
+/// Asio's promise of an awaitable<void>, with the frame from the
+/// coroutine_frame_pool of the worker instead of the heap. It adds no
+/// members, Asio takes it for its own promise.
+template<typename Executor>
+class pooled_awaitable_frame : public asio::detail::awaitable_frame<void, Executor>
+{
+    typedef asio::detail::awaitable_frame<void, Executor> base;
+
+    /// An awaitable co_awaited here, suspending with the handle of the
+    /// promise Asio knows.
+    template<typename T>
+    struct awaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(asio::detail::coroutine_handle<pooled_awaitable_frame> h)
+        {
+            awaitable_.await_suspend(asio::detail::coroutine_handle<base>::from_promise(h.promise()));
+        }
+
+        T await_resume()
+        {
+            return awaitable_.await_resume();
+        }
+
+        asio::awaitable<T, Executor> awaitable_;
+    };
+
+public:
+    using base::await_transform;
+
+    template<typename T>
+    awaiter<T> await_transform(asio::awaitable<T, Executor> a)
+    {
+        return awaiter<T>{std::move(a)};
+    }
+
+    template<typename... Args>
+    void * operator new(std::size_t size, Args &... args)
+    {
+        return frame_pool_of(args...).allocate(size);
+    }
+
+    void operator delete(void * p, std::size_t)
+    {
+        coroutine_frame_pool::deallocate(p);
+    }
+};
+
+#if defined(BOOST_ASIO_HAS_STD_COROUTINE)
+namespace std {
+#else
+namespace std { namespace experimental {
+#endif
+
+// The coroutines of a request use pooled frames: run_request() taking the
+// pool, a handler taking the context, as a function or a lambda, and Asio's
+// co_spawn entry point, which gets request_completion as its last argument.
+// Other coroutines keep Asio's frames.
+template<typename Executor, typename... Args>
+struct coroutine_traits<boost::asio::awaitable<void, Executor>, coroutine_frame_pool &, Args...>
+{
+    typedef pooled_awaitable_frame<Executor> promise_type;
+};
+
+template<typename Executor, typename ConnectionPtr>
+struct coroutine_traits<boost::asio::awaitable<void, Executor>, http_context<ConnectionPtr> &, http_request &>
+{
+    typedef pooled_awaitable_frame<Executor> promise_type;
+};
+
+template<typename Executor, typename Self, typename ConnectionPtr>
+struct coroutine_traits<boost::asio::awaitable<void, Executor>, Self, http_context<ConnectionPtr> &, http_request &>
+{
+    typedef pooled_awaitable_frame<Executor> promise_type;
+};
+
+template<typename Executor, typename Awaitable, typename SpawnExecutor, typename Function>
+struct coroutine_traits<boost::asio::awaitable<void, Executor>, Awaitable, SpawnExecutor, Function, request_completion>
+{
+    typedef pooled_awaitable_frame<Executor> promise_type;
+};
+
+#if defined(BOOST_ASIO_HAS_STD_COROUTINE)
+}
+#else
+}}
+#endif
+
+/// The coroutine owning the context of a request while f runs, see
+/// co_spawn_request().
+template<typename Context, typename Function>
+asio::awaitable<void> run_request(coroutine_frame_pool & pool, Context ctx, http_request & request, Function f)
+{
+    bool failed = false;
+    try
+    {
+        co_await f(ctx, request);
+    }
+    catch(...)
+    {
+        failed = true;
+    }
+
+    // f may have committed or moved the context away itself
+    if(!ctx.valid())
+        co_return;
+
+    if(failed)
+    {
+        ctx.response().result(http::status::internal_server_error);
+        ctx.set_response_body(beast::string_view());
+    }
+    ctx.commit();
+}
+
+/// Starts run_request() once co_spawn enters its coroutine.
+template<typename Context, typename Function>
+struct request_start
+{
+    asio::awaitable<void> operator()()
+    {
+        return run_request(*pool_, std::move(ctx_), *request_, std::move(f_));
+    }
+
+    coroutine_frame_pool * pool_;
+
+    Context ctx_;
+
+    http_request * request_;
+
+    Function f_;
+};
+
+/// Run f, a coroutine called as
+///
+///     asio::awaitable<void> f(context & ctx, http_request & request);
+///
+/// on the executor of the connection of ctx. It may co_await other
+/// operations, e.g. with asio::use_awaitable, and the response is committed
+/// once it returns. An exception escaping f answers 500 with an empty body.
+/// The frames of co_spawn, run_request() and f come from the
+/// coroutine_frame_pool of the connection's worker. The frames of the
+/// operations f awaits with use_awaitable stay with Asio's cache, one per
+/// thread.
+template<typename Context, typename Function>
+void co_spawn_request(Context && ctx, http_request & request, Function f)
+{
+    typedef typename std::decay<Context>::type context_type;
+    auto executor = ctx.connection()->get_executor();
+    coroutine_frame_pool & pool = asio::use_service<coroutine_frame_pool>(executor.context());
+    asio::co_spawn(executor, request_start<context_type, Function>{&pool, std::move(ctx), &request, std::move(f)}, request_completion{&pool});
+}
+
+/// The handler of http_coroutine_connection, running each request in a
+/// coroutine with co_spawn_request().
+struct http_coroutine_handler
+{
+    typedef basic_http_connection<http_coroutine_handler> connection;
+
+    typedef http_context<shared_ptr<connection> > context;
+
+    void handle_request(context && ctx, http_request & request)
+    {
+        // the handler outlives the request with its connection
+        co_spawn_request(std::move(ctx), request, std::cref(request_coroutine_));
+    }
+
+    void handle_close(shared_ptr<connection> c)
+    {
+        close_callback_(c);
+    }
+
+    std::function<asio::awaitable<void>(context &, http_request &)> request_coroutine_;
+
+    std::function<void(shared_ptr<connection>)> close_callback_;
+};
+
+typedef basic_http_connection<http_coroutine_handler> http_coroutine_connection;
+
+typedef shared_ptr<http_coroutine_connection> http_coroutine_connection_ptr;
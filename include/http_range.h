@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include <asio.h>
+
+enum http_range_result
+{
+    // no Range, or one that is ignored: send the whole representation
+    range_none,
+    // a single satisfiable range in [first, last]
+    range_ok,
+    // 416, nothing of the representation is in the range
+    range_unsatisfiable,
+};
+
+inline bool parse_range_number(beast::string_view s, std::uint64_t & n)
+{
+    if(s.empty() || s.size() > 19)
+        return false;
+    n = 0;
+    for(char c : s)
+    {
+        if(c < '0' || c > '9')
+            return false;
+        n = n * 10 + (c - '0');
+    }
+    return true;
+}
+
+/// Parse the value of a Range header against a representation of size
+/// bytes. Only a single byte range is served, a list of ranges or an
+/// invalid value is ignored as RFC 7233 allows.
+inline http_range_result parse_range(beast::string_view value, std::uint64_t size, std::uint64_t & first, std::uint64_t & last)
+{
+    if(value.substr(0, 6) != "bytes=")
+        return range_none;
+    value.remove_prefix(6);
+    if(value.find(',') != beast::string_view::npos)
+        return range_none;
+
+    std::size_t dash = value.find('-');
+    if(dash == beast::string_view::npos)
+        return range_none;
+
+    beast::string_view from = value.substr(0, dash);
+    beast::string_view to = value.substr(dash + 1);
+
+    // bytes=-n, the last n bytes
+    if(from.empty())
+    {
+        std::uint64_t n;
+        if(!parse_range_number(to, n))
+            return range_none;
+        if(n == 0 || size == 0)
+            return range_unsatisfiable;
+        first = size - std::min(n, size);
+        last = size - 1;
+        return range_ok;
+    }
+
+    if(!parse_range_number(from, first))
+        return range_none;
+
+    // bytes=a-, to the end
+    if(to.empty())
+    {
+        last = size - 1;
+    }
+    else
+    {
+        if(!parse_range_number(to, last) || last < first)
+            return range_none;
+        last = std::min(last, size - 1);
+    }
+
+    if(first >= size)
+        return range_unsatisfiable;
+    return range_ok;
+}
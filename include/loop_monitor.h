@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <asio.h>
+#include <worker_metrics.h>
+
+/// What a loop_watchdog found on a worker that missed its heartbeat.
+struct stall_report
+{
+    /// Position of the worker in its watchdog.
+    std::size_t worker_;
+
+    /// Time since the last heartbeat ran.
+    chrono::nanoseconds stalled_;
+
+    /// What the worker said it was running, empty if nothing, see
+    /// loop_monitor::running().
+    std::string handler_;
+
+    std::string target_;
+
+    /// Stack of the worker thread, empty if it did not answer in time.
+    std::vector<void *> frames_;
+
+    /// The frames as symbols, one per line.
+    std::string symbols() const
+    {
+        std::string out;
+        if(frames_.empty())
+            return out;
+
+        char ** names = ::backtrace_symbols(const_cast<void * const *>(frames_.data()), frames_.size());
+        if(names == nullptr)
+            return out;
+        for(std::size_t i = 0; i < frames_.size(); ++i)
+        {
+            out += names[i];
+            out += '\n';
+        }
+        std::free(names);
+        return out;
+    }
+};
+
+/// The heartbeat of one io_context. A timer runs every interval and records
+/// how late it ran in the loop_lag() histogram of the worker_metrics of the
+/// io_context, the time its thread was busy with other handlers. The thread
+/// running the io_context says what it is running with running(), so a
+/// loop_watchdog can tell which handler holds up a late heartbeat.
+class loop_monitor : public context_service<loop_monitor>
+{
+public:
+    static const std::size_t max_frames = 64;
+
+    static const std::size_t target_size = 64;
+
+    explicit loop_monitor(asio::execution_context & context)
+        : context_service(context)
+        , timer_(static_cast<asio::io_context &>(context))
+        , metrics_(asio::use_service<worker_metrics>(context))
+        , enabled_(false)
+        , beats_(0)
+        , last_beat_(0)
+        , sequence_(0)
+        , handler_(nullptr)
+        , target_length_(0)
+        , captured_(false)
+        , frame_count_(0)
+    {
+    }
+
+    /// Beat every interval, call before the io_context runs.
+    void start(chrono::milliseconds interval)
+    {
+        enabled_ = true;
+        interval_ = interval;
+        next_ = chrono::steady_clock::now() + interval_;
+        wait();
+    }
+
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    chrono::milliseconds interval() const
+    {
+        return interval_;
+    }
+
+    /// The thread running the io_context runs handler, e.g. a request
+    /// callback for target, until the next call. handler must be a literal.
+    void running(const char * handler, beast::string_view target = beast::string_view())
+    {
+        if(!enabled_)
+            return;
+
+        // a seqlock, the watchdog retries while the sequence is odd or changed
+        std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        handler_.store(handler, std::memory_order_relaxed);
+        std::size_t length = std::min<std::size_t>(target.size(), std::size_t(target_size));
+        for(std::size_t i = 0; i < length; i += sizeof(std::uint64_t))
+        {
+            std::uint64_t word = 0;
+            std::memcpy(&word, target.data() + i, std::min(sizeof(word), length - i));
+            target_[i / sizeof(word)].store(word, std::memory_order_relaxed);
+        }
+        target_length_.store(length, std::memory_order_relaxed);
+
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    /// Heartbeats run, from any thread.
+    std::uint64_t beats() const
+    {
+        return beats_.load(std::memory_order_acquire);
+    }
+
+    /// When the last heartbeat ran, from any thread.
+    chrono::steady_clock::time_point last_beat() const
+    {
+        return chrono::steady_clock::time_point(chrono::steady_clock::duration(last_beat_.load(std::memory_order_relaxed)));
+    }
+
+    /// Fill report with what the thread is running and its stack, waiting up
+    /// to timeout for the thread to take the signal. From the watchdog thread.
+    void capture(stall_report & report, chrono::milliseconds timeout)
+    {
+        read_running(report);
+
+        captured_.store(false, std::memory_order_relaxed);
+        install_handler();
+        if(::pthread_kill(thread_, capture_signal()) != 0)
+            return;
+
+        auto deadline = chrono::steady_clock::now() + timeout;
+        while(!captured_.load(std::memory_order_acquire))
+        {
+            if(chrono::steady_clock::now() >= deadline)
+                return;
+            std::this_thread::sleep_for(chrono::microseconds(100));
+        }
+        report.frames_.assign(frames_, frames_ + frame_count_);
+    }
+
+private:
+    void shutdown() override
+    {
+        enabled_ = false;
+        error_code ec;
+        timer_.cancel(ec);
+    }
+
+    void wait()
+    {
+        timer_.expires_at(next_);
+        timer_.async_wait([this](const error_code & ec)
+        {
+            if(ec)
+                return;
+            beat();
+            wait();
+        });
+    }
+
+    void beat()
+    {
+        auto now = chrono::steady_clock::now();
+        if(beats_.load(std::memory_order_relaxed) == 0)
+        {
+            thread_ = ::pthread_self();
+            current_pointer() = this;
+            // the first backtrace() may allocate, not in the signal handler
+            void * frame;
+            ::backtrace(&frame, 1);
+        }
+
+        metrics_.loop_lagged(now - next_);
+        next_ = now + interval_;
+        last_beat_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+        beats_.store(beats_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void read_running(stall_report & report)
+    {
+        for(int attempt = 0; attempt < 100; ++attempt)
+        {
+            std::uint64_t before = sequence_.load(std::memory_order_acquire);
+            if(before & 1)
+                continue;
+
+            const char * handler = handler_.load(std::memory_order_relaxed);
+            std::size_t length = target_length_.load(std::memory_order_relaxed);
+            char target[target_size];
+            for(std::size_t i = 0; i < length; i += sizeof(std::uint64_t))
+            {
+                std::uint64_t word = target_[i / sizeof(word)].load(std::memory_order_relaxed);
+                std::memcpy(target + i, &word, std::min(sizeof(word), length - i));
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(sequence_.load(std::memory_order_relaxed) != before)
+                continue;
+
+            report.handler_ = handler != nullptr ? handler : "";
+            report.target_.assign(target, length);
+            return;
+        }
+    }
+
+    static int capture_signal()
+    {
+        return SIGRTMIN + 1;
+    }
+
+    static loop_monitor *& current_pointer()
+    {
+        static thread_local loop_monitor * monitor = nullptr;
+        return monitor;
+    }
+
+    static void install_handler()
+    {
+        static bool installed = []()
+        {
+            struct sigaction sa;
+            std::memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = &loop_monitor::handle_signal;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            return ::sigaction(capture_signal(), &sa, nullptr) == 0;
+        }();
+        (void)installed;
+    }
+
+    /// On the stalled thread.
+    static void handle_signal(int)
+    {
+        loop_monitor * m = current_pointer();
+        if(m == nullptr)
+            return;
+        m->frame_count_ = ::backtrace(m->frames_, max_frames);
+        m->captured_.store(true, std::memory_order_release);
+    }
+
+    asio::steady_timer timer_;
+
+    worker_metrics & metrics_;
+
+    bool enabled_;
+
+    chrono::milliseconds interval_;
+
+    /// When the next heartbeat is due.
+    chrono::steady_clock::time_point next_;
+
+    pthread_t thread_;
+
+    std::atomic<std::uint64_t> beats_;
+
+    /// steady_clock ticks of the last heartbeat.
+    std::atomic<chrono::steady_clock::rep> last_beat_;
+
+    // the running handler, written by the thread running the io_context
+    std::atomic<std::uint64_t> sequence_;
+    std::atomic<const char *> handler_;
+    std::atomic<std::uint64_t> target_[target_size / sizeof(std::uint64_t)];
+    std::atomic<std::size_t> target_length_;
+
+    // the stack, written by the signal handler
+    std::atomic<bool> captured_;
+    void * frames_[max_frames];
+    int frame_count_;
+};
+
+/// A thread watching the loop_monitor of a set of workers. Once a worker
+/// misses its heartbeat by more than a threshold, it captures the stack of
+/// the worker's thread and what it was running, counts a stall in its
+/// worker_metrics and reports it, once per stall. The stack is taken by a
+/// handler of SIGRTMIN + 1 on the stalled thread, a blocking call there may
+/// return EINTR. It must be destroyed before the io_contexts it watches.
+class loop_watchdog : private boost::noncopyable
+{
+public:
+    typedef std::function<void(const stall_report &)> report_callback;
+
+    loop_watchdog()
+        : threshold_(50)
+        , stopping_(false)
+    {
+    }
+
+    ~loop_watchdog()
+    {
+        stop();
+    }
+
+    /// A stall is a heartbeat later than threshold.
+    void set_threshold(chrono::milliseconds threshold)
+    {
+        threshold_ = threshold;
+    }
+
+    /// Called on the watchdog thread for every stall, the default prints it.
+    void set_callback(report_callback cb)
+    {
+        callback_ = std::move(cb);
+    }
+
+    /// Watch the worker running context with a heartbeat every interval, it
+    /// is labelled with its position. Call before start().
+    void add(asio::io_context & context, chrono::milliseconds interval)
+    {
+        loop_monitor & monitor = asio::use_service<loop_monitor>(context);
+        monitor.start(interval);
+        workers_.push_back(watched{&monitor, &asio::use_service<worker_metrics>(context), 0});
+    }
+
+    void start()
+    {
+        thread_ = std::thread([this]()
+        {
+            run();
+        });
+    }
+
+    void stop()
+    {
+        if(!thread_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+    }
+
+private:
+    struct watched
+    {
+        loop_monitor * monitor_;
+
+        worker_metrics * metrics_;
+
+        /// The heartbeat a stall was last reported after.
+        std::uint64_t reported_;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!stopping_)
+        {
+            wakeup_.wait_for(lock, threshold_ / 4);
+            check();
+        }
+    }
+
+    void check()
+    {
+        auto now = chrono::steady_clock::now();
+        for(std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            watched & w = workers_[i];
+            std::uint64_t beats = w.monitor_->beats();
+            if(beats == 0 || beats == w.reported_)
+                continue;
+
+            auto stalled = now - w.monitor_->last_beat();
+            if(stalled <= w.monitor_->interval() + threshold_)
+                continue;
+
+            w.reported_ = beats;
+            w.metrics_->loop_stalled();
+
+            stall_report report;
+            report.worker_ = i;
+            report.stalled_ = chrono::duration_cast<chrono::nanoseconds>(stalled);
+            w.monitor_->capture(report, chrono::milliseconds(100));
+            if(callback_)
+                callback_(report);
+            else
+                print(report);
+        }
+    }
+
+    static void print(const stall_report & report)
+    {
+        std::cerr << "worker " << report.worker_ << " stalled for " << chrono::duration_cast<chrono::milliseconds>(report.stalled_).count() << " ms";
+        if(!report.handler_.empty())
+            std::cerr << " in " << report.handler_ << " " << report.target_;
+        std::cerr << "\n" << report.symbols();
+    }
+
+    std::vector<watched> workers_;
+
+    chrono::milliseconds threshold_;
+
+    report_callback callback_;
+
+    std::thread thread_;
+
+    std::mutex mutex_;
+
+    std::condition_variable wakeup_;
+
+    bool stopping_;
+};
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <boost/optional.hpp>
+
+#include <asio.h>
+
+/// The value returned by the work of an offloaded task, handed to its
+/// done callback with the context.
+template<typename Result>
+struct offload_result
+{
+    template<typename Work>
+    void run(Work & work)
+    {
+        value_ = work();
+    }
+
+    template<typename Done, typename Context>
+    void complete(Done & done, Context && ctx)
+    {
+        done(std::move(ctx), std::move(*value_));
+    }
+
+    boost::optional<Result> value_;
+};
+
+template<>
+struct offload_result<void>
+{
+    template<typename Work>
+    void run(Work & work)
+    {
+        work();
+    }
+
+    template<typename Done, typename Context>
+    void complete(Done & done, Context && ctx)
+    {
+        done(std::move(ctx));
+    }
+};
+
+/// CPU-heavy work of one io_context, run on threads of its own so the
+/// event loop keeps serving other connections meanwhile.
+///
+/// submit() moves the context of a request into a task. A pool thread runs
+/// the work of the task, and the task comes back to the thread running the
+/// io_context through a lock-free list with one eventfd wakeup per batch,
+/// where done is called with the context. Only the task pointer crosses
+/// threads, the reference counts of the context are never touched off the
+/// worker, so work must not touch the context or its connection.
+class offload_pool : public context_service<offload_pool>
+{
+    struct task
+    {
+        virtual ~task()
+        {
+        }
+
+        /// On a pool thread.
+        virtual void run() = 0;
+
+        /// On the thread running the io_context.
+        virtual void complete() = 0;
+
+        task * next_;
+    };
+
+    template<typename Context, typename Work, typename Done>
+    struct bound_task : task
+    {
+        typedef decltype(std::declval<Work &>()()) result_type;
+
+        bound_task(Context && ctx, Work && work, Done && done)
+            : ctx_(std::move(ctx))
+            , work_(std::move(work))
+            , done_(std::move(done))
+            , failed_(false)
+        {
+        }
+
+        void run() override
+        {
+            try
+            {
+                result_.run(work_);
+            }
+            catch(...)
+            {
+                failed_ = true;
+            }
+        }
+
+        void complete() override
+        {
+            if(failed_)
+            {
+                ctx_.response().result(http::status::internal_server_error);
+                ctx_.set_response_body(beast::string_view());
+                ctx_.commit();
+                return;
+            }
+            result_.complete(done_, std::move(ctx_));
+        }
+
+        Context ctx_;
+
+        Work work_;
+
+        Done done_;
+
+        offload_result<result_type> result_;
+
+        bool failed_;
+    };
+
+public:
+    explicit offload_pool(asio::execution_context & context)
+        : context_service(context)
+        , wakeup_(static_cast<asio::io_context &>(context))
+        , thread_count_(1)
+        , capacity_(1024)
+        , pending_(0)
+        , waiting_(false)
+        , stopped_(false)
+        , stopping_(false)
+        , completed_(nullptr)
+    {
+    }
+
+    ~offload_pool()
+    {
+        stop_threads();
+        destroy_tasks();
+    }
+
+    /// Number of pool threads, started by the first submit().
+    void set_threads(std::size_t count)
+    {
+        thread_count_ = std::max<std::size_t>(count, 1);
+    }
+
+    /// Most tasks submitted and not yet completed.
+    void set_capacity(std::size_t capacity)
+    {
+        capacity_ = capacity;
+    }
+
+    /// Tasks submitted and not yet completed.
+    std::size_t size() const
+    {
+        return pending_;
+    }
+
+    /// Run work on a pool thread, then call done(std::move(ctx)) or
+    /// done(std::move(ctx), result) with the value work returned on the
+    /// thread running the io_context. ctx is moved from only if the task is
+    /// taken, false when the pool is full. If work throws, the response is
+    /// a 500 with an empty body instead.
+    template<typename Context, typename Work, typename Done>
+    bool submit(Context && ctx, Work work, Done done)
+    {
+        typedef typename std::remove_reference<Context>::type context_type;
+
+        if(stopped_ || pending_ >= capacity_)
+            return false;
+        if(threads_.empty())
+            start();
+
+        task * t = new bound_task<context_type, Work, Done>(std::move(ctx), std::move(work), std::move(done));
+        ++pending_;
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(t);
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+private:
+    void shutdown() override
+    {
+        stopped_ = true;
+        stop_threads();
+        error_code ec;
+        wakeup_.close(ec);
+        destroy_tasks();
+    }
+
+    void start()
+    {
+        int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd < 0)
+            throw boost::system::system_error(errno, boost::system::system_category(), "eventfd");
+        wakeup_.assign(fd);
+
+        for(std::size_t i = 0; i < thread_count_; ++i)
+            threads_.emplace_back([this]()
+            {
+                run_thread();
+            });
+    }
+
+    void stop_threads()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for(auto & i : threads_)
+            i.join();
+        threads_.clear();
+    }
+
+    /// Tasks left over at shutdown are destroyed with their contexts, like
+    /// the handlers of the io_context.
+    void destroy_tasks()
+    {
+        for(auto i : queue_)
+            delete i;
+        queue_.clear();
+
+        task * t = completed_.exchange(nullptr, std::memory_order_acquire);
+        while(t != nullptr)
+        {
+            task * next = t->next_;
+            delete t;
+            t = next;
+        }
+        pending_ = 0;
+    }
+
+    void run_thread()
+    {
+        for(;;)
+        {
+            task * t;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this]()
+                {
+                    return stopping_ || !queue_.empty();
+                });
+                if(stopping_)
+                    return;
+                t = queue_.front();
+                queue_.pop_front();
+            }
+
+            t->run();
+
+            // push onto the list of completed tasks
+            task * head = completed_.load(std::memory_order_relaxed);
+            do
+            {
+                t->next_ = head;
+            }
+            while(!completed_.compare_exchange_weak(head, t, std::memory_order_release, std::memory_order_relaxed));
+
+            // the worker takes the whole list at once, only the first task
+            // of a batch wakes it
+            if(head == nullptr)
+            {
+                std::uint64_t one = 1;
+                ssize_t n = ::write(wakeup_.native_handle(), &one, sizeof(one));
+                (void)n;
+            }
+        }
+    }
+
+    /// Wait for completed tasks while any are pending.
+    void wait()
+    {
+        if(waiting_)
+            return;
+        waiting_ = true;
+        wakeup_.async_wait(asio::posix::stream_descriptor::wait_read, [this](const error_code & ec)
+        {
+            waiting_ = false;
+            if(ec)
+                return;
+
+            std::uint64_t count;
+            ssize_t n = ::read(wakeup_.native_handle(), &count, sizeof(count));
+            (void)n;
+            complete();
+            if(pending_ != 0)
+                wait();
+        });
+    }
+
+    void complete()
+    {
+        // the list is newest first, complete in order of completion
+        task * t = completed_.exchange(nullptr, std::memory_order_acquire);
+        task * ordered = nullptr;
+        while(t != nullptr)
+        {
+            task * next = t->next_;
+            t->next_ = ordered;
+            ordered = t;
+            t = next;
+        }
+
+        while(ordered != nullptr)
+        {
+            std::unique_ptr<task> done(ordered);
+            ordered = ordered->next_;
+            --pending_;
+            done->complete();
+        }
+    }
+
+    /// eventfd the pool threads signal completed tasks on.
+    asio::posix::stream_descriptor wakeup_;
+
+    std::size_t thread_count_;
+
+    std::size_t capacity_;
+
+    /// Tasks submitted and not yet completed, only used by the worker.
+    std::size_t pending_;
+
+    bool waiting_;
+
+    bool stopped_;
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+
+    std::condition_variable ready_;
+
+    /// Tasks waiting for a pool thread.
+    std::deque<task *> queue_;
+
+    bool stopping_;
+
+    /// Tasks run by the pool threads, newest first.
+    std::atomic<task *> completed_;
+};
+
+/// Offload work of the request of ctx to the pool of its connection's
+/// worker, see offload_pool::submit().
+template<typename Context, typename Work, typename Done>
+inline bool offload(Context && ctx, Work work, Done done)
+{
+    auto & pool = asio::use_service<offload_pool>(ctx.connection()->get_executor().context());
+    return pool.submit(std::forward<Context>(ctx), std::move(work), std::move(done));
+}
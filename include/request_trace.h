@@ -0,0 +1,347 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <asio.h>
+#include <spsc_ring.h>
+
+/// Points in the life of a request, in the order they are reached.
+enum trace_point
+{
+    /// The connection is accepted, only in the first request of a connection.
+    trace_accepted,
+    trace_header_parsed,
+    trace_body_complete,
+    /// The request is handed to the handler.
+    trace_handler_invoked,
+    trace_committed,
+    /// The first byte of the response is handed to a write.
+    trace_write_started,
+    trace_write_completed,
+    trace_point_count,
+};
+
+/// Ticks of the time stamp counter, a read of a few cycles. It is invariant
+/// and synchronized between cores on the CPUs this runs on, so stamps of the
+/// acceptor and the workers compare. Other architectures use steady_clock
+/// nanoseconds.
+inline std::uint64_t trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// One sampled request as it is written to the trace file, zero stamps were
+/// not reached.
+struct trace_record
+{
+    std::uint32_t worker_;
+
+    std::uint32_t connection_;
+
+    std::uint64_t stamps_[trace_point_count];
+};
+
+/// The header of a trace file, followed by trace_record until its end.
+struct trace_file_header
+{
+    char magic_[8];
+
+    /// To convert stamps to time, measured when the file is opened.
+    std::uint64_t ticks_per_second_;
+
+    std::uint32_t point_count_;
+
+    std::uint32_t record_size_;
+};
+
+static const char trace_magic[8] = {'H', 'T', 'T', 'P', 'T', 'R', 'C', '1'};
+
+/// The stamps of the request in a pipeline slot, taken only when the
+/// request is sampled.
+class request_trace
+{
+public:
+    request_trace()
+        : sampled_(false)
+    {
+    }
+
+    bool sampled() const
+    {
+        return sampled_;
+    }
+
+    void start(bool sampled, std::uint64_t accepted)
+    {
+        sampled_ = sampled;
+        if(!sampled_)
+            return;
+        std::memset(stamps_, 0, sizeof(stamps_));
+        stamps_[trace_accepted] = accepted;
+    }
+
+    void mark(trace_point point)
+    {
+        if(sampled_)
+            stamps_[point] = trace_clock();
+    }
+
+    /// Mark point unless it is marked already.
+    void mark_once(trace_point point)
+    {
+        if(sampled_ && stamps_[point] == 0)
+            stamps_[point] = trace_clock();
+    }
+
+    const std::uint64_t * stamps() const
+    {
+        return stamps_;
+    }
+
+    void clear()
+    {
+        sampled_ = false;
+    }
+
+private:
+    bool sampled_;
+
+    std::uint64_t stamps_[trace_point_count];
+};
+
+/// Samples the requests of one io_context and queues their traces for a
+/// trace_writer, through a ring only the thread running the io_context
+/// pushes to. Traces are dropped, and counted, while the ring is full.
+class request_tracer : public context_service<request_tracer>
+{
+public:
+    explicit request_tracer(asio::execution_context & context)
+        : context_service(context)
+        , sample_every_(0)
+        , countdown_(0)
+        , worker_(0)
+        , connections_(0)
+        , accepted_(0)
+        , dropped_(0)
+    {
+    }
+
+    /// Trace one request in every, none when 0. Call before the io_context runs.
+    void enable(std::uint32_t worker, std::size_t every, std::size_t ring_size)
+    {
+        worker_ = worker;
+        sample_every_ = every;
+        countdown_ = every;
+        ring_.reset(new spsc_ring<trace_record>(ring_size));
+    }
+
+    bool enabled() const
+    {
+        return sample_every_ != 0;
+    }
+
+    /// Whether to trace the next request.
+    bool sample()
+    {
+        if(sample_every_ == 0 || --countdown_ != 0)
+            return false;
+        countdown_ = sample_every_;
+        return true;
+    }
+
+    /// Number of the next connection of this worker.
+    std::uint32_t next_connection()
+    {
+        return ++connections_;
+    }
+
+    /// When the next connection was accepted, if on another thread.
+    void set_accepted(std::uint64_t stamp)
+    {
+        accepted_ = stamp;
+    }
+
+    /// When the connection created now was accepted.
+    std::uint64_t take_accepted()
+    {
+        std::uint64_t stamp = accepted_;
+        accepted_ = 0;
+        return stamp != 0 ? stamp : trace_clock();
+    }
+
+    void emit(std::uint32_t connection, const request_trace & trace)
+    {
+        trace_record record;
+        record.worker_ = worker_;
+        record.connection_ = connection;
+        std::memcpy(record.stamps_, trace.stamps(), sizeof(record.stamps_));
+        if(!ring_->push(record))
+            dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /// Traces dropped on a full ring.
+    std::uint64_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    /// For the trace_writer thread.
+    spsc_ring<trace_record> * ring()
+    {
+        return ring_.get();
+    }
+
+private:
+    void shutdown() override
+    {
+    }
+
+    std::size_t sample_every_;
+
+    std::size_t countdown_;
+
+    std::uint32_t worker_;
+
+    std::uint32_t connections_;
+
+    std::uint64_t accepted_;
+
+    std::atomic<std::uint64_t> dropped_;
+
+    std::unique_ptr<spsc_ring<trace_record> > ring_;
+};
+
+/// Writes the traces sampled by the request_tracer of a set of workers to a
+/// binary file from a thread of its own, so the workers never block on the
+/// file. It must be destroyed before the io_contexts it reads from.
+class trace_writer : private boost::noncopyable
+{
+public:
+    trace_writer()
+        : file_(nullptr)
+        , stopping_(false)
+    {
+    }
+
+    ~trace_writer()
+    {
+        close();
+    }
+
+    /// Create the file at path, throws on failure.
+    void open(const std::string & path)
+    {
+        file_ = std::fopen(path.c_str(), "wb");
+        if(file_ == nullptr)
+            throw boost::system::system_error(errno, boost::system::system_category(), "fopen " + path);
+
+        trace_file_header header;
+        std::memcpy(header.magic_, trace_magic, sizeof(header.magic_));
+        header.ticks_per_second_ = ticks_per_second();
+        header.point_count_ = trace_point_count;
+        header.record_size_ = sizeof(trace_record);
+        std::fwrite(&header, sizeof(header), 1, file_);
+    }
+
+    bool is_open() const
+    {
+        return file_ != nullptr;
+    }
+
+    /// Trace one in every requests of the worker running context, it is
+    /// labelled with its position. Call after open() and before start().
+    void add(asio::io_context & context, std::size_t every, std::size_t ring_size = 4096)
+    {
+        request_tracer & tracer = asio::use_service<request_tracer>(context);
+        tracer.enable(tracers_.size(), every, ring_size);
+        tracers_.push_back(&tracer);
+    }
+
+    /// Start flushing every interval.
+    void start(chrono::milliseconds interval = chrono::milliseconds(10))
+    {
+        thread_ = std::thread([this, interval]()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(!stopping_)
+            {
+                wakeup_.wait_for(lock, interval);
+                flush();
+            }
+        });
+    }
+
+    /// Write what is left and close the file.
+    void close()
+    {
+        if(thread_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wakeup_.notify_one();
+            thread_.join();
+        }
+        if(file_ != nullptr)
+            std::fclose(file_);
+        file_ = nullptr;
+    }
+
+private:
+    void flush()
+    {
+        for(auto t : tracers_)
+        {
+            spsc_ring<trace_record> * ring = t->ring();
+            for(trace_record * r = ring->front(); r != nullptr; r = ring->front())
+            {
+                std::fwrite(r, sizeof(*r), 1, file_);
+                ring->pop();
+            }
+        }
+        std::fflush(file_);
+    }
+
+    /// The rate of trace_clock(), against steady_clock over a few milliseconds.
+    static std::uint64_t ticks_per_second()
+    {
+        auto begin = chrono::steady_clock::now();
+        std::uint64_t first = trace_clock();
+        std::this_thread::sleep_for(chrono::milliseconds(20));
+        std::uint64_t last = trace_clock();
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+        return static_cast<std::uint64_t>((last - first) * 1e9 / elapsed);
+    }
+
+    std::FILE * file_;
+
+    std::vector<request_tracer *> tracers_;
+
+    std::thread thread_;
+
+    std::mutex mutex_;
+
+    std::condition_variable wakeup_;
+
+    bool stopping_;
+};
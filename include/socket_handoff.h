@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <asio.h>
+
+/// Passing listening sockets to another process over a unix socket
+/// (SCM_RIGHTS), so a new binary takes over without closing the listen
+/// queues.
+
+typedef asio::local::stream_protocol::socket handoff_socket;
+
+/// Send native handles, the receiver gets its own descriptors of the same sockets.
+inline void send_handles(handoff_socket & sock, const std::vector<int> & handles)
+{
+    uint32_t count = handles.size();
+    iovec iov{&count, sizeof(count)};
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * handles.size()));
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(!handles.empty())
+    {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handles.size());
+        std::memcpy(CMSG_DATA(cmsg), handles.data(), sizeof(int) * handles.size());
+    }
+
+    if(::sendmsg(sock.native_handle(), &msg, MSG_NOSIGNAL) != sizeof(count))
+        throw boost::system::system_error{error_code{errno, boost::system::system_category()}, "send handles"};
+}
+
+/// Receive the handles sent by send_handles().
+inline std::vector<int> receive_handles(handoff_socket & sock)
+{
+    // the kernel limits a message to SCM_MAX_FD (253) descriptors
+    const std::size_t max_handles = 253;
+
+    uint32_t count = 0;
+    iovec iov{&count, sizeof(count)};
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max_handles));
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    if(::recvmsg(sock.native_handle(), &msg, MSG_CMSG_CLOEXEC) != sizeof(count))
+        throw boost::system::system_error{error_code{errno, boost::system::system_category()}, "receive handles"};
+
+    std::vector<int> handles;
+    for(cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::size_t offset = handles.size();
+        handles.resize(offset + n);
+        std::memcpy(handles.data() + offset, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+
+    if(handles.size() != count || (msg.msg_flags & MSG_CTRUNC))
+    {
+        for(int h : handles)
+            ::close(h);
+        throw boost::system::system_error{asio::error::message_size, "receive handles"};
+    }
+
+    return handles;
+}
+
+/// The protocol a listening socket was opened with.
+inline tcp protocol_of(int handle)
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(::getsockname(handle, reinterpret_cast<sockaddr *>(&addr), &len) == 0 && addr.ss_family == AF_INET6)
+        return tcp::v6();
+    return tcp::v4();
+}
+
+/// The address a listening socket is bound to.
+inline tcp::endpoint local_endpoint_of(int handle)
+{
+    tcp::endpoint endpoint;
+    socklen_t len = endpoint.capacity();
+    if(::getsockname(handle, endpoint.data(), &len) == 0)
+        endpoint.resize(len);
+    return endpoint;
+}
+
+/// Whether a listening socket has SO_REUSEPORT, so more sockets can listen
+/// on its address and share its connections.
+inline bool reuses_port(int handle)
+{
+    int value = 0;
+    socklen_t len = sizeof(value);
+    return ::getsockopt(handle, SOL_SOCKET, SO_REUSEPORT, &value, &len) == 0 && value != 0;
+}
+
+/// Waits on a unix socket for the process taking over the server. Sends
+/// it the listening sockets, then calls the handoff callback once the new
+/// process confirmed that it accepts on them.
+class handoff_listener : private noncopyable
+{
+public:
+    typedef std::function<std::vector<int>()> handles_callback;
+
+    typedef std::function<void()> handoff_callback;
+
+    explicit handoff_listener(asio::io_context & context)
+        : acceptor_(context)
+        , sock_(context)
+    {
+    }
+
+    void listen(const std::string & path, handles_callback hc, handoff_callback cb)
+    {
+        handles_callback_ = hc;
+        handoff_callback_ = cb;
+
+        // the new process replaces the path of the old one
+        ::unlink(path.c_str());
+        asio::local::stream_protocol::endpoint endpoint(path);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        start_accept();
+    }
+
+    void close()
+    {
+        error_code ec;
+        acceptor_.close(ec);
+        sock_.close(ec);
+    }
+
+private:
+    void start_accept()
+    {
+        acceptor_.async_accept(sock_, [this] (const error_code & err)
+        {
+            handle_accept(err);
+        });
+    }
+
+    void handle_accept(const error_code & err)
+    {
+        if(err)
+            return;
+
+        try
+        {
+            send_handles(sock_, handles_callback_());
+        }
+        catch(boost::system::system_error &)
+        {
+            error_code ec;
+            sock_.close(ec);
+            return start_accept();
+        }
+
+        // keep serving until the new process accepts
+        asio::async_read(sock_, asio::buffer(ack_), [this](const error_code & ec, std::size_t)
+        {
+            if(ec)
+            {
+                error_code ignore_ec;
+                sock_.close(ignore_ec);
+                return start_accept();
+            }
+            close();
+            handoff_callback_();
+        });
+    }
+
+    asio::local::stream_protocol::acceptor acceptor_;
+
+    handoff_socket sock_;
+
+    char ack_[1];
+
+    handles_callback handles_callback_;
+
+    handoff_callback handoff_callback_;
+};
+
+/// Take over the listening sockets of the server whose handoff_listener
+/// waits at path. adopt is called with the handles, then the old server is
+/// told to stop accepting.
+template<typename Adopt>
+inline void inherit_listeners(asio::io_context & context, const std::string & path, Adopt adopt)
+{
+    handoff_socket sock(context);
+    sock.connect(asio::local::stream_protocol::endpoint(path));
+    adopt(receive_handles(sock));
+    asio::write(sock, asio::buffer("1", 1));
+}
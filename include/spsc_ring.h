@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+/// A bounded lock-free queue between one producer thread and one consumer
+/// thread. Elements are constructed in place by push() and used in place
+/// through front() until pop(), nothing is allocated after construction.
+/// Each side caches the index of the other and only reloads it when the
+/// ring looks full or empty.
+template<typename T>
+class spsc_ring : private boost::noncopyable
+{
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type slot;
+
+    static const std::size_t cache_line = 64;
+
+public:
+    /// Room for capacity elements, rounded up to a power of two.
+    explicit spsc_ring(std::size_t capacity)
+        : mask_(round_up(capacity) - 1)
+        , slots_(new slot[mask_ + 1])
+        , tail_(0)
+        , cached_head_(0)
+        , head_(0)
+        , cached_tail_(0)
+    {
+    }
+
+    ~spsc_ring()
+    {
+        while(front() != nullptr)
+            pop();
+    }
+
+    std::size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+    /// Producer: construct an element at the back, false when full.
+    template<typename... Args>
+    bool push(Args &&... args)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - cached_head_ > mask_)
+        {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if(tail - cached_head_ > mask_)
+                return false;
+        }
+        new (&slots_[tail & mask_]) T(std::forward<Args>(args)...);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer: the element at the front, null when empty.
+    T * front()
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if(head == cached_tail_)
+        {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if(head == cached_tail_)
+                return nullptr;
+        }
+        return reinterpret_cast<T *>(&slots_[head & mask_]);
+    }
+
+    /// Consumer: destroy the element at the front, after front() returned it.
+    void pop()
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        reinterpret_cast<T *>(&slots_[head & mask_])->~T();
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+private:
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t size = 1;
+        while(size < n)
+            size <<= 1;
+        return size;
+    }
+
+    const std::size_t mask_;
+
+    std::unique_ptr<slot[]> slots_;
+
+    // the producer's and the consumer's side on cache lines of their own
+
+    char pad0_[cache_line];
+
+    std::atomic<std::size_t> tail_;
+
+    std::size_t cached_head_;
+
+    char pad1_[cache_line - sizeof(std::atomic<std::size_t>) - sizeof(std::size_t)];
+
+    std::atomic<std::size_t> head_;
+
+    std::size_t cached_tail_;
+
+    char pad2_[cache_line - sizeof(std::atomic<std::size_t>) - sizeof(std::size_t)];
+};
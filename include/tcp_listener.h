@@ -0,0 +1,111 @@
+#pragma once
+
+#include <functional>
+
+#include <asio.h>
+#include <worker_affinity.h>
+
+/// An acceptor passing every accepted socket to a callback, on the
+/// io_context the acceptor belongs to.
+class tcp_listener : private noncopyable
+{
+public:
+    typedef std::function<void(tcp::socket &&)> accept_callback;
+
+    typedef std::function<bool()> admit_callback;
+
+    tcp_listener(asio::io_context & context, accept_callback cb)
+        : acceptor_(context)
+        , sock_(context)
+        , accept_callback_(cb)
+        , retry_(10)
+        , pause_timer_(context)
+    {
+    }
+
+    void listen(const tcp::endpoint & endpoint, bool reuse_port, const worker_affinity & affinity)
+    {
+        // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor_.set_option(asio::external::reuse_port(reuse_port));
+        error_code ec;
+        affinity.bind_acceptor(acceptor_, ec);
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        start_accept();
+    }
+
+    /// Accept on a listening socket opened elsewhere, e.g. one inherited
+    /// from the process that served before this one.
+    void assign(const tcp & protocol, tcp::acceptor::native_handle_type handle)
+    {
+        acceptor_.assign(protocol, handle);
+        start_accept();
+    }
+
+    /// Accept only while cb returns true, checking again every retry while
+    /// it does not. Connections wait in the listen queue meanwhile.
+    void set_admission(admit_callback cb, chrono::milliseconds retry = chrono::milliseconds(10))
+    {
+        admit_callback_ = cb;
+        retry_ = retry;
+    }
+
+    tcp::acceptor::native_handle_type native_handle()
+    {
+        return acceptor_.native_handle();
+    }
+
+    /// Stop accepting. Connections queued on the socket stay with the other
+    /// processes holding it.
+    void close()
+    {
+        error_code ec;
+        acceptor_.close(ec);
+        pause_timer_.cancel();
+    }
+
+private:
+    void start_accept()
+    {
+        if(admit_callback_ && !admit_callback_())
+        {
+            pause_timer_.expires_after(retry_);
+            pause_timer_.async_wait([this](const error_code & ec)
+            {
+                if(!ec && acceptor_.is_open())
+                    start_accept();
+            });
+            return;
+        }
+
+        acceptor_.async_accept(sock_, [this] (const error_code & err)
+        {
+            handle_accept(err);
+        });
+    }
+
+    void handle_accept(const error_code & err)
+    {
+        if(!err)
+        {
+            accept_callback_(std::move(sock_));
+            start_accept();
+        }
+    }
+
+    /// Acceptor used to listen for incoming connections.
+    asio::ip::tcp::acceptor acceptor_;
+
+    tcp::socket sock_;
+
+    accept_callback accept_callback_;
+
+    admit_callback admit_callback_;
+
+    chrono::milliseconds retry_;
+
+    /// Waits while the admit callback refuses connections.
+    asio::steady_timer pause_timer_;
+};
@@ -1,10 +1,20 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <admission_control.h>
 #include <asio.h>
 #include <http_connection.h>
+#include <loop_monitor.h>
+#include <request_trace.h>
+#include <socket_handoff.h>
+#include <tcp_listener.h>
+#include <worker_metrics.h>
 #include <worker_pool.h>
 
 #ifdef HTTP_DISABLE_THREADS
@@ -13,32 +23,142 @@ template<typename WorkerFactory>
 class tcp_server : private noncopyable
 {
     typedef typename WorkerFactory::worker_ptr worker_ptr;
+    typedef typename factory_connection<WorkerFactory>::type connection;
 
 public:
     explicit tcp_server(const tcp::endpoint & endpoint, WorkerFactory & factory)
         : io_context_(1)
 	    , endpoint_(endpoint)
-        , acceptor_(io_context_)
         , worker_(factory.create(io_context_))
-        , sock_(io_context_)
+        , handoff_(io_context_)
+        , drain_timer_(io_context_)
     {
     }
 
     void start(bool reuse_port = false)
     {
-        // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
-        acceptor_.open(endpoint_.protocol());
-        acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
-        acceptor_.set_option(asio::external::reuse_port(reuse_port));
-        acceptor_.bind(endpoint_);
-        acceptor_.listen();
-        start_accept();
+        add_listener().listen(endpoint_, reuse_port, affinity_);
+    }
+
+    /// Start on the listening sockets of the server running with
+    /// enable_handoff(path) instead of opening new ones. That server stops
+    /// accepting and drains once this one accepts.
+    void start_inherited(const std::string & path)
+    {
+        inherit_listeners(io_context_, path, [this](const std::vector<int> & handles)
+        {
+            for(int h : handles)
+                add_listener().assign(protocol_of(h), h);
+        });
+    }
+
+    /// Hand the listening sockets to the next process calling
+    /// start_inherited(path), then drain(drain_timeout).
+    void enable_handoff(const std::string & path, chrono::milliseconds drain_timeout = chrono::seconds(30))
+    {
+        handoff_.listen(path, [this]()
+        {
+            std::vector<int> handles;
+            for(auto & i : listeners_)
+                handles.push_back(i->native_handle());
+            return handles;
+        }, [this, drain_timeout]()
+        {
+            drain(drain_timeout);
+        });
+    }
+
+    /// Stop accepting, let connections write what is in their pipeline and
+    /// close them, then stop once none is left or timeout expired.
+    void drain(chrono::milliseconds timeout)
+    {
+        for(auto & i : listeners_)
+            i->close();
+        handoff_.close();
+
+        std::vector<shared_ptr<connection> > connections;
+        asio::use_service<connection_list<connection> >(io_context_).for_each([&](connection & c)
+        {
+            connections.push_back(c.shared_from_this());
+            return true;
+        });
+        for(auto & i : connections)
+            i->drain();
+
+        wait_drained(chrono::steady_clock::now() + timeout);
+    }
+
+    /// Set where the server thread runs, applied by run().
+    void set_affinity(const worker_affinity & affinity)
+    {
+        affinity_ = affinity;
+    }
+
+    /// Set the run mode of the server thread, call before run().
+    void set_busy_poll(const busy_poll & mode)
+    {
+        busy_poll_ = mode;
+    }
+
+    /// Give the server threads for CPU-heavy work of its handlers, see
+    /// offload(). At most capacity tasks are in flight. Call before run().
+    void set_offload(std::size_t threads, std::size_t capacity)
+    {
+        auto & pool = asio::use_service<offload_pool>(io_context_);
+        pool.set_threads(threads);
+        pool.set_capacity(capacity);
+    }
+
+    /// Answer requests for path with the metrics of the server in the
+    /// Prometheus text format, before they reach the handler. Call before run().
+    void enable_metrics(const std::string & path = "/metrics")
+    {
+        if(metrics_.size() == 0)
+            metrics_.add(io_context_);
+        asio::use_service<worker_metrics>(io_context_).mount(metrics_, path);
+    }
+
+    const metrics_registry & metrics() const
+    {
+        return metrics_;
+    }
+
+    /// Trace one in every requests to a binary file at path, written by a
+    /// thread of its own, see request_tracer. Call once before run().
+    void enable_tracing(const std::string & path, std::size_t every = 100)
+    {
+        traces_.open(path);
+        traces_.add(io_context_, every);
+        traces_.start();
+    }
+
+    /// Run a heartbeat every interval and record how late it runs in the
+    /// http_loop_lag_seconds histogram of metrics(). A thread of its own
+    /// reports every heartbeat later than threshold with the stack of the
+    /// server thread and the request it was serving, to cb or std::cerr,
+    /// see loop_watchdog. Call once before run().
+    void enable_watchdog(chrono::milliseconds interval = chrono::milliseconds(10), chrono::milliseconds threshold = chrono::milliseconds(50), loop_watchdog::report_callback cb = nullptr)
+    {
+        watchdog_.set_threshold(threshold);
+        watchdog_.set_callback(std::move(cb));
+        watchdog_.add(io_context_, interval);
+        watchdog_.start();
+    }
+
+    /// Limit the connections and requests of the server, see
+    /// admission_limits. Call before run().
+    void set_admission(const admission_limits & limits)
+    {
+        asio::use_service<admission_control>(io_context_).set_limits(limits);
     }
 
     /// Run the server's io_context loop.
     void run()
     {
-        io_context_.run();
+        // pinning is best effort, an unknown CPU leaves the thread unpinned
+        error_code ec;
+        affinity_.bind_current_thread(ec);
+        busy_poll_.run(io_context_, asio::use_service<worker_load>(io_context_));
     }
 
     void stop()
@@ -52,33 +172,58 @@ public:
     }
 
 private:
-    void start_accept()
+    tcp_listener & add_listener()
     {
-        acceptor_.async_accept(sock_, [this] (const error_code & err)
+        admission_control & admission = asio::use_service<admission_control>(io_context_);
+        listeners_.emplace_back(new tcp_listener(io_context_, [this, &admission](tcp::socket && sock)
         {
-            handle_accept(err);
+            if(!admission.accepts_connection())
+                return admission.reject(sock);
+            busy_poll_.bind_socket(sock);
+            worker_->handle_connection(std::move(sock));
+        }));
+        listeners_.back()->set_admission([&admission]()
+        {
+            return admission.accepts_connection();
         });
+        return *listeners_.back();
     }
 
-    void handle_accept(const error_code & err)
+    void wait_drained(chrono::steady_clock::time_point deadline)
     {
-        if(!err)
+        if(asio::use_service<worker_load>(io_context_).connections() == 0 || chrono::steady_clock::now() >= deadline)
+            return stop();
+
+        drain_timer_.expires_after(chrono::milliseconds(100));
+        drain_timer_.async_wait([this, deadline](const error_code & ec)
         {
-            worker_->handle_connection(std::move(sock_));
-            start_accept();
-        }
+            if(!ec)
+                wait_drained(deadline);
+        });
     }
 
     asio::io_context io_context_;
 
     tcp::endpoint endpoint_;
 
-    /// Acceptor used to listen for incoming connections.
-    asio::ip::tcp::acceptor acceptor_;
-
     worker_ptr worker_;
 
-    tcp::socket sock_;
+    /// Listeners used to accept incoming connections.
+    std::vector<std::unique_ptr<tcp_listener> > listeners_;
+
+    worker_affinity affinity_;
+
+    busy_poll busy_poll_;
+
+    handoff_listener handoff_;
+
+    asio::steady_timer drain_timer_;
+
+    metrics_registry metrics_;
+
+    trace_writer traces_;
+
+    loop_watchdog watchdog_;
 };
 
 #else
@@ -89,25 +234,98 @@ class tcp_server : private noncopyable
 public:
     typedef worker_manager<WorkerFactory> worker;
 
+    enum accept_mode
+    {
+        /// One acceptor on the server's io_context, sockets are posted to the workers.
+        shared_acceptor,
+        /// Every worker accepts on its own SO_REUSEPORT acceptor, no thread hop.
+        per_worker_acceptor,
+    };
+
     explicit tcp_server(const tcp::endpoint & endpoint, WorkerFactory & factory, std::size_t pool_size = 0)
         : worker_pool_(factory, pool_size)
         , io_context_(1)
 	    , endpoint_(endpoint)
         , acceptor_(io_context_)
+        , rebalance_timer_(io_context_)
+        , accept_timer_(io_context_)
+        , handoff_(io_context_)
+        , drain_timer_(io_context_)
     {
+        worker_pool_.add_sender(io_context_);
     }
 
-    void start(bool reuse_port = false)
+    void start(bool reuse_port = false, accept_mode mode = shared_acceptor)
 	{
+        if(mode == per_worker_acceptor)
+        {
+            // the kernel spreads new connections over the workers' listen queues
+            worker_pool_.listen(endpoint_);
+            return;
+        }
+
 		acceptor_.open(endpoint_.protocol());
 		acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
-        acceptor_.set_option(asio::ip::tcp::acceptor::reuse_port(reuse_port));
+        acceptor_.set_option(asio::external::reuse_port(reuse_port));
         acceptor_.bind(endpoint_);
 		acceptor_.listen();
+        // accept4() takes what is queued until it would block
+        acceptor_.native_non_blocking(true);
 
 		start_accept();
 	}
 
+    /// Start on the listening sockets of the server running with
+    /// enable_handoff(path) instead of opening new ones. They are spread
+    /// over the workers, which accept on them directly, see
+    /// worker_pool::assign(). A single socket without SO_REUSEPORT, e.g. of
+    /// a shared acceptor, stays a shared acceptor posting to every worker.
+    void start_inherited(const std::string & path)
+    {
+        inherit_listeners(io_context_, path, [this](const std::vector<int> & handles)
+        {
+            if(handles.size() == 1 && worker_pool_.size() > 1 && !reuses_port(handles[0]))
+            {
+                acceptor_.assign(protocol_of(handles[0]), handles[0]);
+                acceptor_.native_non_blocking(true);
+                endpoint_ = acceptor_.local_endpoint();
+                return start_accept();
+            }
+            worker_pool_.assign(handles);
+        });
+    }
+
+    /// Hand the listening sockets to the next process calling
+    /// start_inherited(path), then drain(drain_timeout).
+    void enable_handoff(const std::string & path, chrono::milliseconds drain_timeout = chrono::seconds(30))
+    {
+        // handles do not change once the server started
+        std::vector<int> handles = worker_pool_.listener_handles();
+        if(acceptor_.is_open())
+            handles.push_back(acceptor_.native_handle());
+
+        handoff_.listen(path, [handles]()
+        {
+            return handles;
+        }, [this, drain_timeout]()
+        {
+            drain(drain_timeout);
+        });
+    }
+
+    /// Stop accepting, let connections write what is in their pipeline and
+    /// close them, then stop once none is left or timeout expired.
+    void drain(chrono::milliseconds timeout)
+    {
+        error_code ec;
+        acceptor_.close(ec);
+        accept_timer_.cancel();
+        handoff_.close();
+        rebalance_timer_.cancel();
+        worker_pool_.drain();
+        wait_drained(chrono::steady_clock::now() + timeout);
+    }
+
     /// Run the server's io_context loop.
     void run()
     {
@@ -119,10 +337,106 @@ public:
         accept_thread.join();
     }
 
+    /// Worker i runs with affinities[i % affinities.size()], call before run().
+    void set_affinity(const std::vector<worker_affinity> & affinities)
+    {
+        worker_pool_.set_affinity(affinities);
+    }
+
+    /// Run every worker in the given mode, call before run().
+    void set_busy_poll(const busy_poll & mode)
+    {
+        worker_pool_.set_busy_poll(mode);
+    }
+
+    /// Give every worker threads for CPU-heavy work of its handlers, see
+    /// offload(). Call before run().
+    void set_offload(std::size_t threads, std::size_t capacity)
+    {
+        worker_pool_.set_offload(threads, capacity);
+    }
+
+    /// Answer requests for path with the metrics of every worker in the
+    /// Prometheus text format, before they reach the handler. Any worker
+    /// answers for all of them. Call once before run().
+    void enable_metrics(const std::string & path = "/metrics")
+    {
+        worker_pool_.enable_metrics(metrics_, path);
+    }
+
+    const metrics_registry & metrics() const
+    {
+        return metrics_;
+    }
+
+    /// Trace one in every requests of each worker to a binary file at path,
+    /// written by a thread of its own, see request_tracer. The trace of the
+    /// first request of a connection starts at its accept on the server's
+    /// thread. Call once before run().
+    void enable_tracing(const std::string & path, std::size_t every = 100)
+    {
+        traces_.open(path);
+        worker_pool_.enable_tracing(traces_, every);
+        traces_.start();
+    }
+
+    /// Run a heartbeat every interval on each worker and record how late it
+    /// runs in the http_loop_lag_seconds histograms of metrics(). A thread
+    /// of its own reports every heartbeat later than threshold with the
+    /// stack of the stalled worker and the request it was serving, to cb or
+    /// std::cerr, see loop_watchdog. Call once before run().
+    void enable_watchdog(chrono::milliseconds interval = chrono::milliseconds(10), chrono::milliseconds threshold = chrono::milliseconds(50), loop_watchdog::report_callback cb = nullptr)
+    {
+        watchdog_.set_threshold(threshold);
+        watchdog_.set_callback(std::move(cb));
+        worker_pool_.enable_watchdog(watchdog_, interval);
+        watchdog_.start();
+    }
+
+    /// Limit the connections and requests of every worker, see
+    /// admission_limits. The shared acceptor pauses while every worker is
+    /// at its connection limit. Call before run().
+    void set_admission(const admission_limits & limits)
+    {
+        worker_pool_.set_admission(limits);
+    }
+
+    /// Number of workers, e.g. of the values of a worker_local.
+    std::size_t worker_count() const
+    {
+        return worker_pool_.size();
+    }
+
+    /// Choose how the shared acceptor places new connections on workers.
+    void set_placement_policy(placement_policy policy)
+    {
+        worker_pool_.set_placement_policy(policy);
+    }
+
+    /// Every interval, move idle connections away from a worker whose
+    /// request rate stays above ratio times the average, see
+    /// worker_pool::rebalance(). Workers must provide adopt_connection().
+    void enable_rebalancing(chrono::milliseconds interval, double ratio = 1.5, std::size_t sustain = 3, std::size_t batch = 16)
+    {
+        rebalance_timer_.expires_after(interval);
+        rebalance_timer_.async_wait([this, interval, ratio, sustain, batch](const error_code & ec)
+        {
+            if(ec)
+                return;
+            worker_pool_.rebalance(ratio, sustain, batch);
+            enable_rebalancing(interval, ratio, sustain, batch);
+        });
+    }
+
     void stop()
     {
         worker_pool_.stop();
+        rebalance_timer_.cancel();
+        accept_timer_.cancel();
+        drain_timer_.cancel();
+        handoff_.close();
         acceptor_.close();
+        io_context_.stop();
     }
 
 	asio::io_context & get_io_context()
@@ -133,26 +447,69 @@ public:
 private:
     void start_accept()
     {
-        worker & w = worker_pool_.get_worker_manager();
-        sock_ = make_shared<asio::ip::tcp::socket>(w.context());
-        acceptor_.async_accept(*sock_, [this, &w] (const error_code & err)
+        acceptor_.async_wait(tcp::acceptor::wait_read, [this] (const error_code & err)
         {
-            handle_accept(w, err);
+            handle_accept(err);
         });
     }
 
-    void handle_accept(worker & w, const error_code & err)
+    /// Accept what is queued and send every native handle to its worker
+    /// through the worker's mailbox, the socket is only registered with
+    /// the reactor of the worker.
+    void handle_accept(const error_code & err)
     {
-        if(!err)
+        if(err)
+            return;
+
+        worker_mailbox & mailbox = asio::use_service<worker_mailbox>(io_context_);
+        tcp protocol = endpoint_.protocol();
+        for(;;)
         {
-            auto sock = sock_;
-            sock_.reset();
-            w.context().post([&w, sock]()
+            // leave connections in the listen queue while no worker takes them
+            if(!worker_pool_.accepts_connection())
+                return pause_accept();
+
+            int handle = ::accept4(acceptor_.native_handle(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            std::uint64_t accepted = trace_clock();
+            if(handle < 0)
+            {
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    return;
+                break;
+            }
+
+            worker & w = worker_pool_.get_worker_manager();
+            mailbox.post(w.mailbox().index(), [&w, protocol, handle, accepted]()
             {
-                w.handle_connection(std::move(*sock));
+                w.handle_connection(protocol, handle, accepted);
             });
-            start_accept();
         }
+        start_accept();
+    }
+
+    void pause_accept()
+    {
+        accept_timer_.expires_after(chrono::milliseconds(10));
+        accept_timer_.async_wait([this](const error_code & ec)
+        {
+            if(!ec && acceptor_.is_open())
+                start_accept();
+        });
+    }
+
+    void wait_drained(chrono::steady_clock::time_point deadline)
+    {
+        if(worker_pool_.connections() == 0 || chrono::steady_clock::now() >= deadline)
+            return stop();
+
+        drain_timer_.expires_after(chrono::milliseconds(100));
+        drain_timer_.async_wait([this, deadline](const error_code & ec)
+        {
+            if(!ec)
+                wait_drained(deadline);
+        });
     }
 
     worker_pool<WorkerFactory> worker_pool_;
@@ -164,7 +521,20 @@ private:
     /// Acceptor used to listen for incoming connections.
     asio::ip::tcp::acceptor acceptor_;
 
-    shared_ptr<asio::ip::tcp::socket> sock_;
+    asio::steady_timer rebalance_timer_;
+
+    /// Waits while every worker is at its connection limit.
+    asio::steady_timer accept_timer_;
+
+    handoff_listener handoff_;
+
+    asio::steady_timer drain_timer_;
+
+    metrics_registry metrics_;
+
+    trace_writer traces_;
+
+    loop_watchdog watchdog_;
 };
 
 #endif
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include <boost/intrusive/list.hpp>
+
+#include <asio.h>
+
+/// Coarse timeouts of one io_context in a hierarchical timing wheel.
+///
+/// Time advances in ticks of resolution(). Four levels of 64 slots hold
+/// the timers expiring within 64, 64^2, 64^3 and 64^4 ticks, a slot of an
+/// upper level is spread over the level below once its time comes. Arming,
+/// re-arming and cancelling a timer is O(1) and does not allocate, and a
+/// single steady_timer ticks only while timers are armed. Timers fire up
+/// to one tick early or late.
+class timer_wheel : public context_service<timer_wheel>
+{
+    static const unsigned slot_bits = 6;
+    static const std::size_t slot_count = std::size_t(1) << slot_bits;
+    static const std::size_t level_count = 4;
+
+    typedef boost::intrusive::list_member_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink> > hook_type;
+
+public:
+    /// A timeout calling its callback once it expires, e.g. a member of a
+    /// connection. It is cancelled when destroyed.
+    class timer : private boost::noncopyable
+    {
+        friend class timer_wheel;
+
+    public:
+        explicit timer(std::function<void()> callback)
+            : wheel_(nullptr)
+            , expiry_(0)
+            , callback_(std::move(callback))
+        {
+        }
+
+        ~timer()
+        {
+            cancel();
+        }
+
+        bool armed() const
+        {
+            return hook_.is_linked();
+        }
+
+        void cancel()
+        {
+            if(armed())
+                wheel_->remove(*this);
+        }
+
+    private:
+        hook_type hook_;
+
+        timer_wheel * wheel_;
+
+        std::uint64_t expiry_;
+
+        std::function<void()> callback_;
+    };
+
+    explicit timer_wheel(asio::execution_context & context)
+        : context_service(context)
+        , timer_(static_cast<asio::io_context &>(context))
+        , resolution_(chrono::milliseconds(100))
+        , now_(0)
+        , count_(0)
+        , running_(false)
+    {
+    }
+
+    /// Length of a tick, set before arming timers.
+    void set_resolution(chrono::milliseconds resolution)
+    {
+        resolution_ = resolution;
+    }
+
+    chrono::milliseconds resolution() const
+    {
+        return resolution_;
+    }
+
+    /// Number of armed timers.
+    std::size_t size() const
+    {
+        return count_;
+    }
+
+    /// Call the callback of t after timeout, replacing its previous timeout.
+    void arm(timer & t, chrono::milliseconds timeout)
+    {
+        t.cancel();
+        if(!running_)
+            start();
+
+        // now_ lags behind while ticks are caught up
+        std::uint64_t current = (chrono::steady_clock::now() - origin_) / resolution_;
+        std::uint64_t ticks = (timeout.count() + resolution_.count() - 1) / resolution_.count();
+        t.wheel_ = this;
+        t.expiry_ = std::max(current, now_) + std::max<std::uint64_t>(ticks, 1);
+        insert(t);
+        ++count_;
+    }
+
+private:
+    typedef boost::intrusive::list<timer, boost::intrusive::member_hook<timer, hook_type, &timer::hook_>, boost::intrusive::constant_time_size<false> > list_type;
+
+    void shutdown() override
+    {
+        for(auto & level : slots_)
+            for(auto & slot : level)
+                slot.clear();
+        count_ = 0;
+    }
+
+    void remove(timer & t)
+    {
+        t.hook_.unlink();
+        --count_;
+    }
+
+    void insert(timer & t)
+    {
+        // expiries too far away wait in the last slot to come round
+        std::uint64_t delta = t.expiry_ - now_;
+        std::size_t level = 0;
+        while(level + 1 < level_count && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+        if(level + 1 == level_count && delta >= (std::uint64_t(1) << (slot_bits * level_count)))
+            t.expiry_ = now_ + (std::uint64_t(1) << (slot_bits * level_count)) - 1;
+
+        slots_[level][(t.expiry_ >> (slot_bits * level)) & (slot_count - 1)].push_back(t);
+    }
+
+    /// Pick the tick count up from the current time, the wheel stood still
+    /// while no timer was armed.
+    void start()
+    {
+        running_ = true;
+        origin_ = chrono::steady_clock::now() - resolution_ * now_;
+        schedule();
+    }
+
+    void schedule()
+    {
+        timer_.expires_at(origin_ + resolution_ * (now_ + 1));
+        timer_.async_wait([this](const error_code & ec)
+        {
+            if(ec)
+                return;
+            advance();
+        });
+    }
+
+    void advance()
+    {
+        std::uint64_t target = (chrono::steady_clock::now() - origin_) / resolution_;
+        while(now_ < target && count_ != 0)
+        {
+            ++now_;
+            step();
+        }
+
+        if(count_ == 0)
+        {
+            now_ = target;
+            running_ = false;
+            return;
+        }
+        schedule();
+    }
+
+    void step()
+    {
+        // spread the upper slots whose time has come over the lower levels
+        for(std::size_t level = 1; level < level_count; ++level)
+        {
+            if((now_ & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+                break;
+
+            list_type pending;
+            pending.splice(pending.end(), slots_[level][(now_ >> (slot_bits * level)) & (slot_count - 1)]);
+            while(!pending.empty())
+            {
+                timer & t = pending.front();
+                pending.pop_front();
+                insert(t);
+            }
+        }
+
+        // a callback may arm or cancel any timer, also of this slot
+        list_type expired;
+        expired.splice(expired.end(), slots_[0][now_ & (slot_count - 1)]);
+        while(!expired.empty())
+        {
+            timer & t = expired.front();
+            expired.pop_front();
+            --count_;
+            t.callback_();
+        }
+    }
+
+    asio::steady_timer timer_;
+
+    chrono::milliseconds resolution_;
+
+    /// Time of tick 0.
+    chrono::steady_clock::time_point origin_;
+
+    /// The last tick processed.
+    std::uint64_t now_;
+
+    std::size_t count_;
+
+    bool running_;
+
+    std::array<std::array<list_type, slot_count>, level_count> slots_;
+};
@@ -1,19 +1,53 @@
 #pragma once
 
 #include <list>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
+#include <unistd.h>
+
+#include <admission_control.h>
 #include <asio.h>
+#include <busy_poll.h>
+#include <connection_list.h>
+#include <http_connection.h>
+#include <offload_pool.h>
+#include <request_trace.h>
+#include <tcp_listener.h>
+#include <timer_wheel.h>
+#include <worker_affinity.h>
+#include <worker_load.h>
+#include <worker_mailbox.h>
+
+/// The connection type of the workers of WorkerFactory, its
+/// connection_type or http_connection.
+template<typename WorkerFactory, typename = void>
+struct factory_connection
+{
+    typedef http_connection type;
+};
+
+template<typename WorkerFactory>
+struct factory_connection<WorkerFactory, typename std::conditional<true, void, typename WorkerFactory::connection_type>::type>
+{
+    typedef typename WorkerFactory::connection_type type;
+};
 
 template<typename WorkerFactory>
 class worker_manager : private noncopyable
 {
     typedef typename WorkerFactory::worker_ptr worker_ptr;
+    typedef typename factory_connection<WorkerFactory>::type connection;
+    typedef shared_ptr<connection> connection_ptr;
 public:
     typedef shared_ptr<worker_manager<WorkerFactory> > ptr;
 
     worker_manager(WorkerFactory & factory)
         : io_context_()
         , work_guard_(asio::make_work_guard(io_context_))
+        , load_(asio::use_service<worker_load>(io_context_))
+        , admission_(asio::use_service<admission_control>(io_context_))
     {
         worker_ = factory.create(io_context_);
     }
@@ -25,12 +59,149 @@ public:
 
     void handle_connection(asio::ip::tcp::socket && sock)
     {
+        if(!admission_.accepts_connection())
+        {
+            admission_.reject(sock);
+            return;
+        }
+        busy_poll_.bind_socket(sock);
         worker_->handle_connection(std::move(sock));
     }
 
+    /// Take a socket accepted on another thread as a native handle, so it
+    /// is registered with this worker's reactor only. accepted is the
+    /// trace_clock() of the accept, see request_tracer.
+    void handle_connection(const tcp & protocol, tcp::socket::native_handle_type handle, std::uint64_t accepted = 0)
+    {
+        tcp::socket sock(io_context_);
+        error_code ec;
+        sock.assign(protocol, handle, ec);
+        if(ec)
+        {
+            ::close(handle);
+            return;
+        }
+        asio::use_service<request_tracer>(io_context_).set_accepted(accepted);
+        handle_connection(std::move(sock));
+    }
+
+    /// Open a SO_REUSEPORT acceptor of this worker on endpoint and accept
+    /// directly on the worker's io_context.
+    void listen(const tcp::endpoint & endpoint)
+    {
+        add_listener().listen(endpoint, true, affinity_);
+    }
+
+    /// Accept on a listening socket inherited from another process.
+    void assign(const tcp & protocol, tcp::acceptor::native_handle_type handle)
+    {
+        add_listener().assign(protocol, handle);
+    }
+
+    /// Native handles of this worker's listening sockets.
+    std::vector<int> listener_handles()
+    {
+        std::vector<int> handles;
+        for(auto & i : listeners_)
+            handles.push_back(i->native_handle());
+        return handles;
+    }
+
+    /// Stop accepting and close every connection once its pipeline is
+    /// written. Must run on this worker's thread.
+    void drain()
+    {
+        for(auto & i : listeners_)
+            i->close();
+
+        // closing may release the last reference, collect them first
+        std::vector<connection_ptr> connections;
+        asio::use_service<connection_list<connection> >(io_context_).for_each([&](connection & c)
+        {
+            connections.push_back(c.shared_from_this());
+            return true;
+        });
+        for(auto & i : connections)
+            i->drain();
+    }
+
+    /// Hand up to count idle connections of this worker over to target.
+    /// Must run on this worker's thread.
+    std::size_t migrate_idle(std::size_t count, worker_manager & target)
+    {
+        std::size_t migrated = 0;
+        auto & connections = asio::use_service<connection_list<connection> >(io_context_);
+        connections.for_each([&](connection & c)
+        {
+            if(migrated == count)
+                return false;
+            if(c.migrate(target.context(), [&target](connection_ptr conn)
+            {
+                target.adopt_connection(conn);
+            }))
+            {
+                ++migrated;
+            }
+            return true;
+        });
+        return migrated;
+    }
+
+    /// Take over a connection migrated from another worker, the worker
+    /// object must provide adopt_connection(connection_ptr).
+    void adopt_connection(connection_ptr conn)
+    {
+        worker_->adopt_connection(conn);
+    }
+
+    /// Bytes held by this worker's connections, see
+    /// http_connection::memory_usage(). Must run on this worker's thread.
+    std::size_t connection_memory()
+    {
+        std::size_t size = 0;
+        asio::use_service<connection_list<connection> >(io_context_).for_each([&](connection & c)
+        {
+            size += c.memory_usage();
+            return true;
+        });
+        return size;
+    }
+    
+    /// Set where the worker thread runs, applied by run().
+    void set_affinity(const worker_affinity & affinity)
+    {
+        affinity_ = affinity;
+    }
+
+    /// Set the tick of the worker's timer wheel, which keeps the connection
+    /// timeouts. Call before run().
+    void set_timer_resolution(chrono::milliseconds resolution)
+    {
+        asio::use_service<timer_wheel>(io_context_).set_resolution(resolution);
+    }
+    
+    /// Give the worker threads for CPU-heavy work of its handlers, see
+    /// offload(). At most capacity tasks are in flight. Call before run().
+    void set_offload(std::size_t threads, std::size_t capacity)
+    {
+        auto & pool = asio::use_service<offload_pool>(io_context_);
+        pool.set_threads(threads);
+        pool.set_capacity(capacity);
+    }
+    
+    /// Set the run mode of the worker, call before run().
+    void set_busy_poll(const busy_poll & mode)
+    {
+        busy_poll_ = mode;
+    }
+
     void run()
     {
-        io_context_.run();
+        // pinning is best effort, an unknown CPU leaves the thread unpinned
+        error_code ec;
+        affinity_.bind_current_thread(ec);
+        asio::use_service<worker_mailbox>(io_context_).bind_current_thread();
+        busy_poll_.run(io_context_, load_);
     }
 
     void stop()
@@ -43,7 +214,45 @@ public:
         return io_context_;
     }
 
+    /// Load counters of this worker, safe to read from any thread.
+    inline const worker_load & load() const
+    {
+        return load_;
+    }
+
+    /// Limit the connections and requests of this worker, call before run().
+    void set_admission(const admission_limits & limits)
+    {
+        admission_.set_limits(limits);
+    }
+
+    /// Whether this worker takes another connection, from any thread.
+    bool accepts_connection() const
+    {
+        return admission_.accepts_connection();
+    }
+
+    /// The mailbox other workers send messages to this one through, its
+    /// index() is the position of this worker in its pool.
+    worker_mailbox & mailbox()
+    {
+        return asio::use_service<worker_mailbox>(io_context_);
+    }
+
 private:
+    tcp_listener & add_listener()
+    {
+        listeners_.emplace_back(new tcp_listener(io_context_, [this](tcp::socket && sock)
+        {
+            handle_connection(std::move(sock));
+        }));
+        listeners_.back()->set_admission([this]()
+        {
+            return admission_.accepts_connection();
+        });
+        return *listeners_.back();
+    }
+
     std::function<void(asio::ip::tcp::socket &&)> new_connection_callback_;
 
     asio::io_context io_context_;
@@ -51,4 +260,15 @@ private:
     asio::executor_work_guard<asio::io_context::executor_type> work_guard_;
 
     worker_ptr worker_;
+
+    worker_load & load_;
+
+    admission_control & admission_;
+
+    worker_affinity affinity_;
+
+    busy_poll busy_poll_;
+
+    /// Listeners used when every worker accepts on its own SO_REUSEPORT socket.
+    std::vector<std::unique_ptr<tcp_listener> > listeners_;
 };
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+#include <asio.h>
+
+/// Where a worker thread runs and allocates its memory.
+struct worker_affinity
+{
+    worker_affinity()
+        : local_memory(false)
+        , incoming_cpu(false)
+    {
+    }
+
+    explicit worker_affinity(std::vector<int> c, bool local = true, bool incoming = false)
+        : cpus(std::move(c))
+        , local_memory(local)
+        , incoming_cpu(incoming)
+    {
+    }
+
+    /// CPUs the worker thread may run on, empty means no pinning.
+    std::vector<int> cpus;
+
+    /// Allocate the memory of the worker thread (its connections, buffers
+    /// and pipelines) on the NUMA node it runs on.
+    bool local_memory;
+
+    /// Set SO_INCOMING_CPU of the worker's acceptor to its first CPU, so a
+    /// SO_REUSEPORT group hands it the connections whose packets are
+    /// received on that CPU (line the CPUs up with the RSS/XPS queues).
+    bool incoming_cpu;
+
+    /// Apply to the calling thread.
+    void bind_current_thread(error_code & ec) const
+    {
+        ec = error_code{};
+        if(!cpus.empty())
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(int cpu : cpus)
+                CPU_SET(cpu, &set);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if(err)
+            {
+                ec = error_code{err, boost::system::system_category()};
+                return;
+            }
+        }
+
+        // the preferred policy without nodes is local allocation, pages are
+        // placed on the node of the CPU touching them first
+        if(local_memory && ::syscall(SYS_set_mempolicy, MPOL_PREFERRED, nullptr, 0) != 0)
+        {
+            ec = error_code{errno, boost::system::system_category()};
+        }
+    }
+
+    /// Apply to an acceptor of the worker.
+    template<typename Acceptor>
+    void bind_acceptor(Acceptor & acceptor, error_code & ec) const
+    {
+        ec = error_code{};
+        if(incoming_cpu && !cpus.empty())
+        {
+            acceptor.set_option(asio::external::incoming_cpu(cpus.front()), ec);
+        }
+    }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+
+#include <asio.h>
+
+/// Load counters of one io_context.
+///
+/// Only the thread running the io_context writes them, so an update is a
+/// relaxed load and store instead of a locked read-modify-write. Other
+/// threads (the acceptor) read them without locks.
+class worker_load : public context_service<worker_load>
+{
+public:
+    explicit worker_load(asio::execution_context & context)
+        : context_service(context)
+        , connections_(0)
+        , outstanding_(0)
+        , requests_(0)
+        , spin_time_(0)
+        , sleep_time_(0)
+    {
+    }
+
+    /// Number of open connections on this worker.
+    std::size_t connections() const
+    {
+        return connections_.load(std::memory_order_relaxed);
+    }
+
+    /// Number of requests read but not yet written back.
+    std::size_t outstanding() const
+    {
+        return outstanding_.load(std::memory_order_relaxed);
+    }
+
+    /// Number of requests read since the worker started.
+    std::size_t requests() const
+    {
+        return requests_.load(std::memory_order_relaxed);
+    }
+
+    /// Time the run loop spun on poll() without finding work.
+    chrono::nanoseconds spin_time() const
+    {
+        return chrono::nanoseconds(spin_time_.load(std::memory_order_relaxed));
+    }
+
+    /// Time the run loop blocked in the reactor, with the handler that woke it.
+    chrono::nanoseconds sleep_time() const
+    {
+        return chrono::nanoseconds(sleep_time_.load(std::memory_order_relaxed));
+    }
+
+    void connection_opened()
+    {
+        add(connections_, 1);
+    }
+
+    void connection_closed()
+    {
+        add(connections_, -1);
+    }
+
+    void request_started(std::size_t n = 1)
+    {
+        add(outstanding_, n);
+        add(requests_, n);
+    }
+
+    void request_finished(std::size_t n = 1)
+    {
+        add(outstanding_, -n);
+    }
+
+    void spun(chrono::nanoseconds t)
+    {
+        add(spin_time_, t.count());
+    }
+
+    void slept(chrono::nanoseconds t)
+    {
+        add(sleep_time_, t.count());
+    }
+
+private:
+    void shutdown() override
+    {
+    }
+
+    template<typename T, typename N>
+    static void add(std::atomic<T> & counter, N n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + static_cast<T>(n), std::memory_order_relaxed);
+    }
+
+    // keep the counters of different workers on different cache lines,
+    // services are heap allocated so alignas is not honoured before C++17
+    char head_padding_[64];
+
+    std::atomic<std::size_t> connections_;
+
+    std::atomic<std::size_t> outstanding_;
+
+    std::atomic<std::size_t> requests_;
+
+    std::atomic<std::uint64_t> spin_time_;
+
+    std::atomic<std::uint64_t> sleep_time_;
+
+    char tail_padding_[64 - 3 * sizeof(std::atomic<std::size_t>) - 2 * sizeof(std::atomic<std::uint64_t>)];
+};
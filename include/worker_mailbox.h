@@ -0,0 +1,462 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <boost/optional.hpp>
+
+#include <asio.h>
+#include <spsc_ring.h>
+
+/// A callable sent through a worker_mailbox. It is stored in place when it
+/// fits in inline_size bytes, a larger one is allocated.
+class worker_message : private boost::noncopyable
+{
+public:
+    static const std::size_t inline_size = 48;
+
+    template<typename Function>
+    explicit worker_message(Function && f)
+    {
+        typedef typename std::decay<Function>::type function_type;
+        construct<function_type>(std::forward<Function>(f), std::integral_constant<bool, sizeof(function_type) <= inline_size && alignof(function_type) <= alignof(storage_type)>());
+    }
+
+    ~worker_message()
+    {
+        destroy_(&storage_);
+    }
+
+    void operator()()
+    {
+        invoke_(&storage_);
+    }
+
+private:
+    typedef typename std::aligned_storage<inline_size>::type storage_type;
+
+    template<typename Function, typename Arg>
+    void construct(Arg && f, std::true_type)
+    {
+        new (&storage_) Function(std::forward<Arg>(f));
+        invoke_ = [](void * p)
+        {
+            (*static_cast<Function *>(p))();
+        };
+        destroy_ = [](void * p)
+        {
+            static_cast<Function *>(p)->~Function();
+        };
+    }
+
+    template<typename Function, typename Arg>
+    void construct(Arg && f, std::false_type)
+    {
+        new (&storage_) Function *(new Function(std::forward<Arg>(f)));
+        invoke_ = [](void * p)
+        {
+            (**static_cast<Function **>(p))();
+        };
+        destroy_ = [](void * p)
+        {
+            delete *static_cast<Function **>(p);
+        };
+    }
+
+    storage_type storage_;
+
+    void (*invoke_)(void *);
+
+    void (*destroy_)(void *);
+};
+
+/// Messages between the workers of a pool, shared nothing but the rings.
+///
+/// Every sender has a bounded ring of its own to every receiver, so a
+/// message is pushed without locks or allocation. A receiver drains all of
+/// its rings on the thread running its io_context, woken through one eventfd
+/// written once per drain however many messages arrive meanwhile. A message
+/// runs and is destroyed on the receiver, it must own what it carries, e.g.
+/// not the single-threaded shared_ptr of HTTP_DISABLE_THREADS. The messages
+/// of one sender run in the order they were sent.
+class worker_mailbox : public context_service<worker_mailbox>
+{
+    typedef spsc_ring<worker_message> ring;
+
+    /// From one sender to one receiver. Once the ring is full, post()
+    /// queues the messages behind it under a lock, and the sender keeps
+    /// queueing until the receiver has taken the queue after the ring.
+    struct channel
+    {
+        explicit channel(std::size_t ring_size)
+            : ring_(ring_size)
+            , overflowed_(false)
+        {
+        }
+
+        ring ring_;
+
+        std::atomic<bool> overflowed_;
+
+        std::mutex mutex_;
+
+        std::deque<worker_message> overflow_;
+    };
+
+    struct peer
+    {
+        worker_mailbox * mailbox_;
+
+        channel * channel_;
+    };
+
+public:
+    explicit worker_mailbox(asio::execution_context & context)
+        : context_service(context)
+        , context_(static_cast<asio::io_context &>(context))
+        , wakeup_(context_)
+        , index_(0)
+        , signalled_(false)
+    {
+    }
+
+    /// Let every mailbox of senders send to every one of receivers, through
+    /// a ring of ring_size messages per pair. A receiver's index() is its
+    /// position in receivers, mailboxes may be both. Call again to add
+    /// senders, always before the io_contexts run.
+    static void connect(const std::vector<worker_mailbox *> & receivers, const std::vector<worker_mailbox *> & senders, std::size_t ring_size)
+    {
+        for(std::size_t i = 0; i < receivers.size(); ++i)
+        {
+            receivers[i]->index_ = i;
+            receivers[i]->open();
+        }
+
+        for(auto s : senders)
+        {
+            for(auto r : receivers)
+            {
+                r->inbound_.emplace_back(new channel(ring_size));
+                s->outbound_.push_back(peer{r, r->inbound_.back().get()});
+            }
+        }
+    }
+
+    /// The mailbox of the worker running the calling thread, see bind_current_thread().
+    static worker_mailbox * current()
+    {
+        return current_pointer();
+    }
+
+    /// Make this the current() mailbox of the calling thread, the one
+    /// running its io_context.
+    void bind_current_thread()
+    {
+        current_pointer() = this;
+    }
+
+    /// Position of this mailbox among the receivers it was connected with.
+    std::size_t index() const
+    {
+        return index_;
+    }
+
+    /// Number of receivers this mailbox sends to.
+    std::size_t size() const
+    {
+        return outbound_.size();
+    }
+
+    asio::io_context & context()
+    {
+        return context_;
+    }
+
+    /// Run f on the thread of receiver to, false when the ring to it is
+    /// full or messages posted before wait behind it. Call on the thread
+    /// running this mailbox's io_context.
+    template<typename Function>
+    bool send(std::size_t to, Function && f)
+    {
+        peer & p = outbound_[to];
+        if(p.channel_->overflowed_.load(std::memory_order_acquire) || !p.channel_->ring_.push(std::forward<Function>(f)))
+            return false;
+        p.mailbox_->signal();
+        return true;
+    }
+
+    /// Like send(), but queued behind the ring when it is full, so it is
+    /// never dropped nor run before the messages sent before it.
+    template<typename Function>
+    void post(std::size_t to, Function f)
+    {
+        if(send(to, f))
+            return;
+
+        peer & p = outbound_[to];
+        {
+            std::lock_guard<std::mutex> lock(p.channel_->mutex_);
+            p.channel_->overflow_.emplace_back(std::move(f));
+            p.channel_->overflowed_.store(true, std::memory_order_relaxed);
+        }
+        p.mailbox_->signal();
+    }
+
+private:
+    static worker_mailbox *& current_pointer()
+    {
+        static thread_local worker_mailbox * mailbox = nullptr;
+        return mailbox;
+    }
+
+    void shutdown() override
+    {
+        error_code ec;
+        wakeup_.close(ec);
+        inbound_.clear();
+        outbound_.clear();
+    }
+
+    void open()
+    {
+        if(wakeup_.is_open())
+            return;
+
+        int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd < 0)
+            throw boost::system::system_error(errno, boost::system::system_category(), "eventfd");
+        wakeup_.assign(fd);
+        wait();
+    }
+
+    /// Called by senders on their threads.
+    void signal()
+    {
+        // the message is in the ring before the flag is read, the flag is
+        // cleared before the rings are, so either this sender or the
+        // draining receiver sees the other's write
+        if(!signalled_.exchange(true, std::memory_order_seq_cst))
+        {
+            std::uint64_t one = 1;
+            ssize_t n = ::write(wakeup_.native_handle(), &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    void wait()
+    {
+        wakeup_.async_wait(asio::posix::stream_descriptor::wait_read, [this](const error_code & ec)
+        {
+            if(ec)
+                return;
+
+            std::uint64_t count;
+            ssize_t n = ::read(wakeup_.native_handle(), &count, sizeof(count));
+            (void)n;
+            signalled_.store(false, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            drain();
+            wait();
+        });
+    }
+
+    void drain()
+    {
+        // a ring's worth per round, a worker sending to itself cannot hold
+        // the loop, later messages signalled another wakeup
+        for(auto & c : inbound_)
+        {
+            ring & r = c->ring_;
+            std::size_t count = r.capacity();
+            while(count-- != 0)
+            {
+                worker_message * m = r.front();
+                if(m == nullptr)
+                    break;
+                (*m)();
+                r.pop();
+            }
+
+            // the queue follows what is left in the ring
+            if(c->overflowed_.load(std::memory_order_acquire) && r.front() == nullptr)
+            {
+                std::deque<worker_message> overflow;
+                {
+                    std::lock_guard<std::mutex> lock(c->mutex_);
+                    overflow.swap(c->overflow_);
+                    c->overflowed_.store(false, std::memory_order_release);
+                }
+                for(auto & m : overflow)
+                    m();
+            }
+        }
+    }
+
+    asio::io_context & context_;
+
+    /// eventfd the senders write to wake this receiver.
+    asio::posix::stream_descriptor wakeup_;
+
+    std::size_t index_;
+
+    /// A wakeup is written and not yet drained.
+    std::atomic<bool> signalled_;
+
+    /// Channels from every sender to this receiver.
+    std::vector<std::unique_ptr<channel> > inbound_;
+
+    /// Rings from this sender to every receiver, by receiver index.
+    std::vector<peer> outbound_;
+};
+
+/// The result of a worker_local::call(), kept from its work to its done.
+template<typename Result>
+class worker_call_result
+{
+public:
+    template<typename Work, typename Value>
+    void run(Work & work, Value & value)
+    {
+        result_ = work(value);
+    }
+
+    template<typename Done>
+    void deliver(Done & done)
+    {
+        done(std::move(*result_));
+    }
+
+private:
+    boost::optional<Result> result_;
+};
+
+/// A work returning nothing, done() takes no argument.
+template<>
+class worker_call_result<void>
+{
+public:
+    template<typename Work, typename Value>
+    void run(Work & work, Value & value)
+    {
+        work(value);
+    }
+
+    template<typename Done>
+    void deliver(Done & done)
+    {
+        done();
+    }
+};
+
+/// One T per worker of a pool, e.g. the shard of a table each worker owns.
+/// A value is only used on the thread of its worker, other workers send it
+/// work through their mailboxes with post() or call(), no lock is taken.
+template<typename T>
+class worker_local : private boost::noncopyable
+{
+    template<typename Function>
+    struct bound_post
+    {
+        void operator()()
+        {
+            f_(*value_);
+        }
+
+        T * value_;
+
+        Function f_;
+    };
+
+    /// A call lives on the heap from its start to its reply, only the
+    /// pointer travels between the workers.
+    template<typename Work, typename Done>
+    struct call_state
+    {
+        typedef decltype(std::declval<Work &>()(std::declval<T &>())) result_type;
+
+        call_state(Work && work, Done && done)
+            : work_(std::move(work))
+            , done_(std::move(done))
+        {
+        }
+
+        Work work_;
+
+        Done done_;
+
+        worker_call_result<result_type> result_;
+    };
+
+public:
+    /// count values of T, one per worker.
+    explicit worker_local(std::size_t count)
+    {
+        // on allocations of their own, no two workers write the same line
+        for(std::size_t i = 0; i < count; ++i)
+            values_.emplace_back(new T());
+    }
+
+    std::size_t size() const
+    {
+        return values_.size();
+    }
+
+    /// The value of worker index, only to be used on its thread.
+    T & at(std::size_t index)
+    {
+        return *values_[index];
+    }
+
+    /// The value of the worker running the calling thread.
+    T & local()
+    {
+        return at(worker_mailbox::current()->index());
+    }
+
+    /// Run f(value) on the worker owning value index. Call on a worker thread.
+    template<typename Function>
+    void post(std::size_t index, Function f)
+    {
+        worker_mailbox::current()->post(index, bound_post<Function>{values_[index].get(), std::move(f)});
+    }
+
+    /// Run work(value) on the worker owning value index, then done(result)
+    /// with the value work returned back on the calling worker, or done()
+    /// if work returns void. work and done do not leave the heap in
+    /// between, so done may keep the context of a request. Call on a worker
+    /// thread.
+    template<typename Work, typename Done>
+    void call(std::size_t index, Work work, Done done)
+    {
+        typedef call_state<Work, Done> state_type;
+
+        worker_mailbox * origin = worker_mailbox::current();
+        std::size_t from = origin->index();
+        T * value = values_[index].get();
+        state_type * state = new state_type(std::move(work), std::move(done));
+        origin->post(index, [state, value, from]()
+        {
+            state->result_.run(state->work_, *value);
+            worker_mailbox::current()->post(from, [state]()
+            {
+                std::unique_ptr<state_type> s(state);
+                s->result_.deliver(s->done_);
+            });
+        });
+    }
+
+private:
+    std::vector<std::unique_ptr<T> > values_;
+};
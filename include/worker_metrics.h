@@ -0,0 +1,403 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <asio.h>
+#include <worker_load.h>
+
+/// A histogram with log-linear buckets like HdrHistogram: every power of
+/// two is split into sub_count buckets, about 12% wide. One thread records,
+/// any thread reads while it does.
+class latency_histogram : private boost::noncopyable
+{
+public:
+    static const unsigned sub_bits = 3;
+    static const std::size_t sub_count = std::size_t(1) << sub_bits;
+    static const std::size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+    latency_histogram()
+        : count_(0)
+        , sum_(0)
+    {
+        for(auto & i : buckets_)
+            i.store(0, std::memory_order_relaxed);
+    }
+
+    void record(std::uint64_t value)
+    {
+        add(buckets_[bucket_of(value)], 1);
+        add(count_, 1);
+        add(sum_, value);
+    }
+
+    std::uint64_t count() const
+    {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t sum() const
+    {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    /// Values recorded up to limit, which must be a power of two or zero.
+    std::uint64_t count_below(std::uint64_t limit) const
+    {
+        std::uint64_t n = 0;
+        std::size_t end = limit == 0 ? 0 : bucket_of(limit);
+        for(std::size_t i = 0; i < end; ++i)
+            n += buckets_[i].load(std::memory_order_relaxed);
+        return n;
+    }
+
+    /// The value below which fraction q of the values recorded are, the
+    /// upper bound of its bucket.
+    std::uint64_t quantile(double q) const
+    {
+        std::uint64_t total = 0;
+        std::array<std::uint64_t, bucket_count> counts;
+        for(std::size_t i = 0; i < bucket_count; ++i)
+        {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        std::uint64_t rank = static_cast<std::uint64_t>(q * total);
+        std::uint64_t seen = 0;
+        for(std::size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += counts[i];
+            if(seen > rank)
+                return upper_bound(i);
+        }
+        return 0;
+    }
+
+private:
+    static std::size_t bucket_of(std::uint64_t value)
+    {
+        if(value < sub_count)
+            return value;
+        unsigned high = 63 - __builtin_clzll(value);
+        return (high - sub_bits + 1) * sub_count + ((value >> (high - sub_bits)) & (sub_count - 1));
+    }
+
+    static std::uint64_t upper_bound(std::size_t bucket)
+    {
+        if(bucket < sub_count)
+            return bucket;
+        unsigned shift = bucket / sub_count - 1;
+        std::uint64_t first = (sub_count + bucket % sub_count) << shift;
+        return first + (std::uint64_t(1) << shift) - 1;
+    }
+
+    static void add(std::atomic<std::uint64_t> & counter, std::uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> buckets_;
+
+    std::atomic<std::uint64_t> count_;
+
+    std::atomic<std::uint64_t> sum_;
+};
+
+class metrics_registry;
+
+/// Metrics of one io_context, next to its worker_load.
+///
+/// Like worker_load only the thread running the io_context records them,
+/// with relaxed loads and stores, and other threads read them while it
+/// runs. Latencies are in nanoseconds.
+class worker_metrics : public context_service<worker_metrics>
+{
+public:
+    explicit worker_metrics(asio::execution_context & context)
+        : context_service(context)
+        , accepts_(0)
+        , bytes_in_(0)
+        , bytes_out_(0)
+        , stalls_(0)
+        , shed_(0)
+        , rejected_(0)
+        , registry_(nullptr)
+    {
+    }
+
+    /// Connections accepted since the worker started.
+    std::uint64_t accepts() const
+    {
+        return accepts_.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t bytes_in() const
+    {
+        return bytes_in_.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t bytes_out() const
+    {
+        return bytes_out_.load(std::memory_order_relaxed);
+    }
+
+    /// Requests in the pipeline of a connection once one is read.
+    const latency_histogram & pipeline_depth() const
+    {
+        return pipeline_depth_;
+    }
+
+    /// From a request read to its response committed.
+    const latency_histogram & commit_latency() const
+    {
+        return commit_latency_;
+    }
+
+    /// From a response committed to its last byte handed to the socket.
+    const latency_histogram & flush_latency() const
+    {
+        return flush_latency_;
+    }
+
+    /// How late the heartbeat of the worker ran, see loop_monitor.
+    const latency_histogram & loop_lag() const
+    {
+        return loop_lag_;
+    }
+
+    /// Heartbeats missed by more than the threshold of a loop_watchdog.
+    std::uint64_t stalls() const
+    {
+        return stalls_.load(std::memory_order_relaxed);
+    }
+
+    /// Requests answered 503 by admission_control.
+    std::uint64_t shed() const
+    {
+        return shed_.load(std::memory_order_relaxed);
+    }
+
+    /// Connections closed with a 503 by admission_control.
+    std::uint64_t rejected() const
+    {
+        return rejected_.load(std::memory_order_relaxed);
+    }
+
+    void connection_accepted()
+    {
+        add(accepts_, 1);
+    }
+
+    void bytes_read(std::size_t n)
+    {
+        add(bytes_in_, n);
+    }
+
+    void bytes_written(std::size_t n)
+    {
+        add(bytes_out_, n);
+    }
+
+    void request_queued(std::size_t depth)
+    {
+        pipeline_depth_.record(depth);
+    }
+
+    void request_committed(chrono::steady_clock::duration t)
+    {
+        commit_latency_.record(chrono::duration_cast<chrono::nanoseconds>(t).count());
+    }
+
+    void response_flushed(chrono::steady_clock::duration t)
+    {
+        flush_latency_.record(chrono::duration_cast<chrono::nanoseconds>(t).count());
+    }
+
+    void loop_lagged(chrono::steady_clock::duration t)
+    {
+        loop_lag_.record(chrono::duration_cast<chrono::nanoseconds>(t).count());
+    }
+
+    /// Called by the loop_watchdog, its only writer.
+    void loop_stalled()
+    {
+        add(stalls_, 1);
+    }
+
+    void request_shed()
+    {
+        add(shed_, 1);
+    }
+
+    void connection_rejected()
+    {
+        add(rejected_, 1);
+    }
+
+    /// Answer requests for path with the metrics of registry instead of
+    /// passing them to the handler. Call before the io_context runs.
+    void mount(const metrics_registry & registry, const std::string & path)
+    {
+        registry_ = &registry;
+        path_ = path;
+    }
+
+    /// The registry mounted at target, or null.
+    const metrics_registry * mounted(beast::string_view target) const
+    {
+        if(registry_ == nullptr || target != path_)
+            return nullptr;
+        return registry_;
+    }
+
+private:
+    void shutdown() override
+    {
+    }
+
+    static void add(std::atomic<std::uint64_t> & counter, std::uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // keep the counters of different workers on different cache lines,
+    // services are heap allocated so alignas is not honoured before C++17
+    char head_padding_[64];
+
+    std::atomic<std::uint64_t> accepts_;
+
+    std::atomic<std::uint64_t> bytes_in_;
+
+    std::atomic<std::uint64_t> bytes_out_;
+
+    latency_histogram pipeline_depth_;
+
+    latency_histogram commit_latency_;
+
+    latency_histogram flush_latency_;
+
+    latency_histogram loop_lag_;
+
+    std::atomic<std::uint64_t> stalls_;
+
+    std::atomic<std::uint64_t> shed_;
+
+    std::atomic<std::uint64_t> rejected_;
+
+    const metrics_registry * registry_;
+
+    std::string path_;
+
+    char tail_padding_[64];
+};
+
+/// The metrics of a set of workers, gathered from their counters while
+/// they run, without stopping them.
+class metrics_registry : private boost::noncopyable
+{
+    struct worker
+    {
+        const worker_load * load_;
+
+        const worker_metrics * metrics_;
+    };
+
+public:
+    /// Add the worker running context, it is labelled with its position.
+    void add(asio::io_context & context)
+    {
+        workers_.push_back(worker{&asio::use_service<worker_load>(context), &asio::use_service<worker_metrics>(context)});
+    }
+
+    std::size_t size() const
+    {
+        return workers_.size();
+    }
+
+    /// All metrics in the Prometheus text exposition format, one series per
+    /// worker.
+    std::string prometheus() const
+    {
+        std::string out;
+        counter(out, "http_accepts_total", "counter", "Connections accepted.", [](const worker & w) { return w.metrics_->accepts(); });
+        counter(out, "http_connections", "gauge", "Open connections.", [](const worker & w) { return std::uint64_t(w.load_->connections()); });
+        counter(out, "http_requests_total", "counter", "Requests read.", [](const worker & w) { return std::uint64_t(w.load_->requests()); });
+        counter(out, "http_requests_in_flight", "gauge", "Requests read and not yet written.", [](const worker & w) { return std::uint64_t(w.load_->outstanding()); });
+        counter(out, "http_requests_shed_total", "counter", "Requests answered 503 by admission control.", [](const worker & w) { return w.metrics_->shed(); });
+        counter(out, "http_connections_rejected_total", "counter", "Connections closed with a 503 by admission control.", [](const worker & w) { return w.metrics_->rejected(); });
+        counter(out, "http_received_bytes_total", "counter", "Bytes read from connections.", [](const worker & w) { return w.metrics_->bytes_in(); });
+        counter(out, "http_sent_bytes_total", "counter", "Bytes written to connections.", [](const worker & w) { return w.metrics_->bytes_out(); });
+        histogram(out, "http_pipeline_depth", "Requests in the pipeline of a connection once one is read.", &worker_metrics::pipeline_depth, 0, 8, 1);
+        histogram(out, "http_request_commit_seconds", "Time from a request read to its response committed.", &worker_metrics::commit_latency, 10, 35, 1e-9);
+        histogram(out, "http_response_flush_seconds", "Time from a response committed to it written to the socket.", &worker_metrics::flush_latency, 10, 35, 1e-9);
+        histogram(out, "http_loop_lag_seconds", "How late the heartbeat of the event loop ran.", &worker_metrics::loop_lag, 10, 35, 1e-9);
+        counter(out, "http_loop_stalls_total", "counter", "Heartbeats missed by more than the watchdog threshold.", [](const worker & w) { return w.metrics_->stalls(); });
+        return out;
+    }
+
+private:
+    template<typename Value>
+    void counter(std::string & out, const char * name, const char * type, const char * help, Value value) const
+    {
+        header(out, name, type, help);
+        for(std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            out += name;
+            out += "{worker=\"" + std::to_string(i) + "\"} ";
+            out += std::to_string(value(workers_[i]));
+            out += '\n';
+        }
+    }
+
+    /// Buckets at the powers of two from 2^first to 2^last, times scale.
+    void histogram(std::string & out, const char * name, const char * help, const latency_histogram & (worker_metrics::*get)() const, unsigned first, unsigned last, double scale) const
+    {
+        header(out, name, "histogram", help);
+        for(std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            const latency_histogram & h = (workers_[i].metrics_->*get)();
+            std::string worker = "worker=\"" + std::to_string(i) + "\"";
+
+            // read the total first, the buckets may only have grown since
+            std::uint64_t count = h.count();
+            std::uint64_t sum = h.sum();
+            for(unsigned e = first; e <= last; ++e)
+            {
+                std::uint64_t limit = std::uint64_t(1) << e;
+                out += std::string(name) + "_bucket{" + worker + ",le=\"" + number((limit - 1) * scale) + "\"} ";
+                out += std::to_string(std::min(h.count_below(limit), count)) + '\n';
+            }
+            out += std::string(name) + "_bucket{" + worker + ",le=\"+Inf\"} " + std::to_string(count) + '\n';
+            out += std::string(name) + "_sum{" + worker + "} " + number(sum * scale) + '\n';
+            out += std::string(name) + "_count{" + worker + "} " + std::to_string(count) + '\n';
+        }
+    }
+
+    static void header(std::string & out, const char * name, const char * type, const char * help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    static std::string number(double value)
+    {
+        char buf[32];
+        int n = std::snprintf(buf, sizeof(buf), "%.9g", value);
+        return std::string(buf, n);
+    }
+
+    std::vector<worker> workers_;
+};
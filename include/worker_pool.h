@@ -4,7 +4,24 @@
 #include <vector>
 
 #include <asio.h>
+#include <loop_monitor.h>
+#include <socket_handoff.h>
 #include <worker.h>
+#include <worker_mailbox.h>
+#include <worker_metrics.h>
+
+/// How worker_pool chooses the worker of a new connection.
+enum placement_policy
+{
+    /// Every worker in turn.
+    round_robin,
+    /// The worker with the fewest open connections.
+    least_connections,
+    /// The less loaded of two randomly chosen workers.
+    power_of_two_choices,
+    /// The worker with the fewest requests in flight.
+    least_outstanding_requests,
+};
 
 /// A pool of worker objects.
 template<typename WorkerFactory>
@@ -14,6 +31,9 @@ class worker_pool
 public:
     worker_pool(WorkerFactory & factory, std::size_t pool_size)
         : next_worker_(0)
+        , policy_(round_robin)
+        , random_(0x9e3779b97f4a7c15ull)
+        , imbalance_(0)
         , factory_(factory)
     {
         if (pool_size == 0)
@@ -23,6 +43,30 @@ public:
         {
             workers_.push_back(make_shared<worker_manager<WorkerFactory> >(factory_));
         }
+
+        // every worker can message every other one
+        std::vector<worker_mailbox *> mailboxes;
+        for(auto i : workers_)
+            mailboxes.push_back(&i->mailbox());
+        worker_mailbox::connect(mailboxes, mailboxes, mailbox_size);
+    }
+
+    /// Messages a worker queues to another one before they are posted.
+    static const std::size_t mailbox_size = 256;
+
+    /// Let the thread running context send messages to every worker through
+    /// its mailbox, e.g. an acceptor. Call before run().
+    void add_sender(asio::io_context & context)
+    {
+        std::vector<worker_mailbox *> mailboxes;
+        for(auto i : workers_)
+            mailboxes.push_back(&i->mailbox());
+        worker_mailbox::connect(mailboxes, {&asio::use_service<worker_mailbox>(context)}, mailbox_size);
+    }
+
+    std::size_t size() const
+    {
+        return workers_.size();
     }
 
     void run()
@@ -43,21 +87,257 @@ public:
             i->join();
     }
 
+    /// Worker i runs with affinities[i % affinities.size()], call before run().
+    void set_affinity(const std::vector<worker_affinity> & affinities)
+    {
+        if(affinities.empty())
+            return;
+        for(std::size_t i = 0; i < workers_.size(); ++i)
+            workers_[i]->set_affinity(affinities[i % affinities.size()]);
+    }
+
+    /// Run every worker in the given mode, call before run().
+    void set_busy_poll(const busy_poll & mode)
+    {
+        for(auto i : workers_)
+            i->set_busy_poll(mode);
+    }
+
+    /// Give every worker threads of its own for offloaded work, call before run().
+    void set_offload(std::size_t threads, std::size_t capacity)
+    {
+        for(auto i : workers_)
+            i->set_offload(threads, capacity);
+    }
+
+    /// Gather the metrics of every worker in registry and let each one
+    /// answer requests for path with them, call before run().
+    void enable_metrics(metrics_registry & registry, const std::string & path)
+    {
+        for(auto i : workers_)
+        {
+            registry.add(i->context());
+            asio::use_service<worker_metrics>(i->context()).mount(registry, path);
+        }
+    }
+
+    /// Trace one in every requests of each worker to writer, call before run().
+    void enable_tracing(trace_writer & writer, std::size_t every)
+    {
+        for(auto i : workers_)
+            writer.add(i->context(), every);
+    }
+
+    /// Beat every interval on each worker, watched by watchdog. Call before run().
+    void enable_watchdog(loop_watchdog & watchdog, chrono::milliseconds interval)
+    {
+        for(auto i : workers_)
+            watchdog.add(i->context(), interval);
+    }
+
+    /// Limit the connections and requests of every worker, call before run().
+    void set_admission(const admission_limits & limits)
+    {
+        for(auto i : workers_)
+            i->set_admission(limits);
+    }
+
+    /// Whether any worker takes another connection.
+    bool accepts_connection()
+    {
+        for(auto i : workers_)
+            if(i->accepts_connection())
+                return true;
+        return false;
+    }
+
+    /// Let every worker accept on its own acceptor bound to endpoint.
+    void listen(const tcp::endpoint & endpoint)
+    {
+        for(auto i : workers_)
+            i->listen(endpoint);
+    }
+
+    /// Spread listening sockets inherited from another process over the
+    /// workers, call before run(). A worker left without one listens on the
+    /// address of one with SO_REUSEPORT, the kernel spreads the connections
+    /// over both.
+    void assign(const std::vector<int> & handles)
+    {
+        for(std::size_t i = 0; i < handles.size(); ++i)
+            workers_[i % workers_.size()]->assign(protocol_of(handles[i]), handles[i]);
+
+        for(std::size_t i = handles.size(); i < workers_.size() && !handles.empty(); ++i)
+        {
+            int handle = handles[i % handles.size()];
+            if(reuses_port(handle))
+                workers_[i]->listen(local_endpoint_of(handle));
+        }
+    }
+
+    std::vector<int> listener_handles()
+    {
+        std::vector<int> handles;
+        for(auto i : workers_)
+        {
+            std::vector<int> h = i->listener_handles();
+            handles.insert(handles.end(), h.begin(), h.end());
+        }
+        return handles;
+    }
+
+    /// Drain every worker on its own thread.
+    void drain()
+    {
+        for(auto i : workers_)
+        {
+            asio::post(i->context(), [i]()
+            {
+                i->drain();
+            });
+        }
+    }
+
+    /// Open connections of all workers.
+    std::size_t connections()
+    {
+        std::size_t n = 0;
+        for(auto i : workers_)
+            n += i->load().connections();
+        return n;
+    }
+
     void stop()
     {
         for(auto i : workers_)
             i->stop();
     }
 
+    void set_placement_policy(placement_policy policy)
+    {
+        policy_ = policy;
+    }
+
     worker_manager<WorkerFactory> & get_worker_manager()
     {
         // Use a round-robin scheme to choose the next io_context to use.
         ++next_worker_;
         next_worker_ %= workers_.size();
-        return *workers_[next_worker_];
+
+        std::size_t index;
+        switch(policy_)
+        {
+        case least_connections:
+            index = least_loaded(&worker_load::connections);
+            break;
+        case least_outstanding_requests:
+            index = least_loaded(&worker_load::outstanding);
+            break;
+        case power_of_two_choices:
+            index = two_choices();
+            break;
+        default:
+            index = next_worker_;
+            break;
+        }
+
+        // a worker over its connection limit would reject the connection
+        if(!workers_[index]->accepts_connection())
+            index = least_loaded(&worker_load::connections);
+        return *workers_[index];
+    }
+
+    /// Compare the request rate of the workers since the last call. Once the
+    /// busiest worker served more than ratio times the average for sustain
+    /// consecutive calls, up to batch of its idle connections are moved to
+    /// the least busy worker. Call it periodically from one thread.
+    void rebalance(double ratio, std::size_t sustain, std::size_t batch)
+    {
+        requests_.resize(workers_.size(), 0);
+
+        std::size_t busiest = 0;
+        std::size_t idlest = 0;
+        std::size_t total = 0;
+        std::vector<std::size_t> rates(workers_.size());
+        for(std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            std::size_t requests = workers_[i]->load().requests();
+            rates[i] = requests - requests_[i];
+            requests_[i] = requests;
+            total += rates[i];
+            if(rates[i] > rates[busiest])
+                busiest = i;
+            if(rates[i] < rates[idlest])
+                idlest = i;
+        }
+
+        if(busiest == idlest || rates[busiest] * workers_.size() <= ratio * total)
+        {
+            imbalance_ = 0;
+            return;
+        }
+
+        if(++imbalance_ < sustain)
+            return;
+        imbalance_ = 0;
+
+        worker_manager<WorkerFactory> & from = *workers_[busiest];
+        worker_manager<WorkerFactory> & to = *workers_[idlest];
+        asio::post(from.context(), [&from, &to, batch]()
+        {
+            from.migrate_idle(batch, to);
+        });
     }
 
 private:
+    typedef std::size_t (worker_load::*load_counter)() const;
+
+    /// Total order of worker loads, in-flight requests break connection ties.
+    std::size_t load_of(std::size_t index)
+    {
+        const worker_load & load = workers_[index]->load();
+        return load.connections() + load.outstanding();
+    }
+
+    std::size_t least_loaded(load_counter counter)
+    {
+        // start the scan at the round-robin position so ties are spread
+        std::size_t best = next_worker_;
+        std::size_t best_load = (workers_[best]->load().*counter)();
+        for(std::size_t i = 1; i < workers_.size() && best_load != 0; ++i)
+        {
+            std::size_t index = (next_worker_ + i) % workers_.size();
+            std::size_t load = (workers_[index]->load().*counter)();
+            if(load < best_load)
+            {
+                best = index;
+                best_load = load;
+            }
+        }
+        return best;
+    }
+
+    std::size_t two_choices()
+    {
+        if(workers_.size() < 2)
+            return 0;
+
+        std::size_t first = random() % workers_.size();
+        std::size_t second = random() % (workers_.size() - 1);
+        if(second >= first)
+            ++second;
+        return load_of(second) < load_of(first) ? second : first;
+    }
+
+    /// xorshift64, only called from the accepting thread.
+    std::uint64_t random()
+    {
+        random_ ^= random_ << 13;
+        random_ ^= random_ >> 7;
+        random_ ^= random_ << 17;
+        return random_;
+    }
+
     typedef asio::executor_work_guard<asio::io_context::executor_type> io_context_work;
     typedef typename worker_manager<WorkerFactory>::ptr worker_ptr;
 
@@ -67,5 +347,15 @@ private:
     /// The next io_context to use for a connection.
     std::size_t next_worker_;
 
+    placement_policy policy_;
+
+    std::uint64_t random_;
+
+    /// Requests counters seen by the last rebalance().
+    std::vector<std::size_t> requests_;
+
+    /// Consecutive rebalance() calls that saw an imbalance.
+    std::size_t imbalance_;
+
     WorkerFactory & factory_;
 };
@@ -27,6 +27,7 @@ public:
 
     void start()
     {
+        start_time_ = chrono::steady_clock::now();
         for(size_t i = 0; i < clients_.size(); ++i)
         {
             do_connect(i);
@@ -67,7 +68,7 @@ public:
         clients_[i].request_ = http_request{};
         clients_[i].request_.method(http::verb::post);
         clients_[i].request_.target("/pipeline");
-        clients_[i].request_.body() = body_;
+        clients_[i].request_.body().assign(body_.data(), body_.size());
         clients_[i].request_.set("seq", std::to_string(clients_[i].index_));
         clients_[i].request_.prepare_payload();
 
@@ -101,6 +102,9 @@ public:
             if(++resp_num_ == require_num_)
             {
                 std::cout << "finish" << std::endl;
+                auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time_);
+                std::cout << "elapsed: " << elapsed.count() / 1000.0 << "ms, "
+                    << resp_num_ * 1000000.0 / elapsed.count() << " requests/s" << std::endl;
                 for(auto & i : clients_)
                 {
                     error_code ec;
@@ -146,6 +150,8 @@ private:
 
     std::string body_;
 
+    chrono::steady_clock::time_point start_time_;
+
 public:
     size_t require_num_;
     size_t req_num_;
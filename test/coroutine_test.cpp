@@ -0,0 +1,138 @@
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include <asio.h>
+#include <http_coroutine.h>
+
+// run coroutine handlers of http_coroutine.h against a client on the same
+// io_context, check their responses and that a steady load takes every
+// frame of a request from the worker's coroutine_frame_pool
+//
+//     coroutine_test [requests]
+
+static int failures = 0;
+
+static void check(bool ok, const std::string & what)
+{
+    if(!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// GET /timer answers after a timer, /throw throws, anything else echoes the target
+static asio::awaitable<void> handle(http_coroutine_handler::context & ctx, http_request & request)
+{
+    std::string target(request.target());
+    if(target == "/timer")
+    {
+        asio::steady_timer timer(co_await asio::this_coro::executor, chrono::milliseconds(1));
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+    if(target == "/throw")
+        throw std::runtime_error("handler failed");
+
+    ctx.response().result(http::status::ok);
+    ctx.response().body().assign(target.data(), target.size());
+    ctx.response().prepare_payload();
+}
+
+typedef http::response<http::string_body> client_response;
+
+static asio::awaitable<void> send(tcp::socket & sock, std::string target)
+{
+    std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+    co_await asio::async_write(sock, asio::buffer(request), asio::use_awaitable);
+}
+
+static asio::awaitable<client_response> receive(tcp::socket & sock, beast::flat_buffer & buffer)
+{
+    client_response response;
+    co_await http::async_read(sock, buffer, response, asio::use_awaitable);
+    co_return response;
+}
+
+static asio::awaitable<void> client(tcp::endpoint endpoint, coroutine_frame_pool & pool, std::size_t requests)
+{
+    tcp::socket sock(co_await asio::this_coro::executor);
+    co_await sock.async_connect(endpoint, asio::use_awaitable);
+    beast::flat_buffer buffer;
+
+    co_await send(sock, "/a");
+    client_response r = co_await receive(sock, buffer);
+    check(r.result() == http::status::ok && r.body() == "/a", "echo");
+
+    co_await send(sock, "/throw");
+    r = co_await receive(sock, buffer);
+    check(r.result() == http::status::internal_server_error && r.body().empty(), "an exception answers 500");
+
+    // the timer holds the first response, the second waits for it
+    co_await send(sock, "/timer");
+    co_await send(sock, "/b");
+    r = co_await receive(sock, buffer);
+    check(r.body() == "/timer", "pipelined responses in order");
+    r = co_await receive(sock, buffer);
+    check(r.body() == "/b", "pipelined responses in order");
+
+    for(std::size_t i = 0; i < 100; ++i)
+    {
+        co_await send(sock, "/warm");
+        co_await receive(sock, buffer);
+    }
+
+    std::size_t before = pool.heap_allocations();
+    for(std::size_t i = 0; i < requests; ++i)
+    {
+        co_await send(sock, i % 10 == 0 ? "/timer" : "/x");
+        r = co_await receive(sock, buffer);
+        if(r.result() != http::status::ok)
+        {
+            check(false, "steady load");
+            break;
+        }
+    }
+    std::size_t after = pool.heap_allocations();
+    std::cout << "frames from the heap: " << before << " warming up, " << after - before << " for " << requests << " requests" << std::endl;
+    check(after == before, "no frame from the heap in steady state");
+
+    error_code ec;
+    sock.shutdown(tcp::socket::shutdown_both, ec);
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t requests = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000;
+
+    asio::io_context context;
+    tcp::acceptor acceptor(context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::set<http_coroutine_connection_ptr> connections;
+    acceptor.async_accept([&](const error_code & ec, tcp::socket sock)
+    {
+        if(ec)
+            return;
+        http_coroutine_handler handler{&handle, [&connections](http_coroutine_connection_ptr c)
+        {
+            connections.erase(c);
+        }};
+        auto c = ::make_shared<http_coroutine_connection>(std::move(sock), handler, 16);
+        connections.insert(c);
+        c->start();
+    });
+
+    coroutine_frame_pool & pool = asio::use_service<coroutine_frame_pool>(context);
+    asio::co_spawn(context, client(acceptor.local_endpoint(), pool, requests), [&](std::exception_ptr e)
+    {
+        if(e)
+            check(false, "client failed");
+        acceptor.close();
+    });
+    context.run();
+
+    if(failures != 0)
+        return 1;
+    std::cout << "ok" << std::endl;
+    return 0;
+}
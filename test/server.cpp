@@ -1,18 +1,43 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <set>
 
+#include <unistd.h>
+
 #include <asio.h>
 #include <tcp_server.h>
 #include <http_connection.h>
 
+class http_worker;
+
+// bind connections to their worker at compile time
+struct http_worker_handler
+{
+    typedef basic_http_connection<http_worker_handler> connection;
+
+    void handle_request(http_context<shared_ptr<connection> > && ctx, http_request & request);
+
+    void handle_close(shared_ptr<connection> conn);
+
+    http_worker * worker_;
+};
+
+typedef http_worker_handler::connection worker_connection;
+
 class http_worker
 {
 public:
-    http_worker(asio::io_context & context, std::size_t index)
-        : context_(context)
+    http_worker(asio::io_context & context, std::size_t index, chrono::milliseconds idle_release)
+        : idle_release_(idle_release)
+        , context_(context)
         , timer_(context)
     {
+        timeouts_.idle_ = chrono::seconds(30);
+        timeouts_.header_ = chrono::seconds(10);
+        timeouts_.body_ = chrono::seconds(30);
+        timeouts_.write_ = chrono::seconds(30);
         std::cout << "start worker: " << index << std::endl;
         start_timer();
     }
@@ -29,36 +54,35 @@ public:
     void handle_connection(asio::ip::tcp::socket && sock)
     {
         //std::cout << "new connection" << std::endl;
-        auto req_cb = [this](http_connection::context && ctx, http_request & request)
-        {
-            handle_request(std::move(ctx), request);
-        };
-        auto close_cb = [this](http_connection_ptr conn)
-        {
-            handle_close(conn);
-        };
-
-        auto s = make_shared<http_connection>(std::move(sock), req_cb, close_cb, 10);
-        connections_[s] = chrono::steady_clock::now();
+        auto s = asio::use_service<connection_pool<worker_connection> >(context_).create(std::move(sock), http_worker_handler{this}, 10);
+        // echo large bodies straight from the read buffer
+        s->enable_body_view(4096);
+        s->set_timeouts(timeouts_);
+        // keep little more than the socket while waiting for the next request
+        s->enable_idle_release(idle_release_);
+        connections_.insert(s);
         s->start();
     }
 
-    void handle_request(http_connection::context && ctx, http_request & request)
+    void adopt_connection(shared_ptr<worker_connection> conn)
+    {
+        conn->rebind(http_worker_handler{this});
+        conn->set_timeouts(timeouts_);
+        connections_.insert(conn);
+        conn->start();
+    }
+
+    void handle_request(worker_connection::context && ctx, http_request & request)
     {
-        if(connections_.find(ctx.connection()) == connections_.end())
-            return;
-        
         //std::cout << "handle request" << std::endl;
-        connections_[ctx.connection()] = chrono::steady_clock::now();
         //std::cout << "request " << ctx.index() << ", body: " << request.body() << std::endl;
         http_response & response = ctx.response();
-        response.body() = std::move(request.body());
-        response.prepare_payload();
         auto iter = request.find("seq");
         if(iter != request.end())
         {
             response.set("seq", iter->value());
         }
+        ctx.set_response_body(ctx.request_body());
         ctx.commit();
 
         // use timer
@@ -76,71 +100,111 @@ public:
         //    std::cout << "response " << ctx.index() << ", body: " << ctx.response().body() << std::endl;
         //    ctx.commit();
         //});
+
+        // or with C++20, as a coroutine of http_coroutine.h committed once it returns
+        //co_spawn_request(std::move(ctx), request, [this](worker_connection::context & ctx, http_request & request) -> asio::awaitable<void>
+        //{
+        //    asio::steady_timer t(context_, std::chrono::milliseconds(std::rand()%100));
+        //    co_await t.async_wait(asio::use_awaitable);
+        //});
+
+        // or compute on the worker's offload threads, see tcp_server::set_offload()
+        //std::string body(request.body());
+        //offload(std::move(ctx), [body]()
+        //{
+        //    return std::string(body.rbegin(), body.rend());
+        //}, [](worker_connection::context && ctx, std::string reversed)
+        //{
+        //    ctx.response().body() = reversed;
+        //    ctx.response().prepare_payload();
+        //    ctx.commit();
+        //});
     }
 
     void handle_timeout(const error_code & ec)
     {
-        std::cout << "connection num: " << http_connection::connectionCount_ << std::endl;
+        std::cout << "connection num: " << worker_connection::connectionCount_ << std::endl;
         if(!ec)
         {
-            auto expire = chrono::steady_clock::now() - chrono::seconds(30);
-            for(auto iter = connections_.begin(); iter != connections_.end();)
-            {
-                if(iter->second < expire)
-                {
-                    std::cout << "stop" << std::endl;
-                    iter->first->stop();
-                    iter = connections_.erase(iter);
-                }
-                else
-                {
-                    ++iter;
-                }
-            }
             start_timer();
         }
     }
 
-    void handle_close(http_connection_ptr conn)
+    void handle_close(shared_ptr<worker_connection> conn)
     {
         //std::cout << ">>> remaining: " << connections_.size() << std::endl;
         connections_.erase(conn);
         std::cout << "handle close, remaining: " << connections_.size() << std::endl;
     }
 
-    std::map<shared_ptr<http_connection>, chrono::steady_clock::time_point> connections_;
+    std::set<shared_ptr<worker_connection> > connections_;
+
+    worker_connection::timeouts timeouts_;
+
+    chrono::milliseconds idle_release_;
 
     asio::io_context & context_;
 
     asio::steady_timer timer_;
 };
 
+inline void http_worker_handler::handle_request(http_context<shared_ptr<connection> > && ctx, http_request & request)
+{
+    worker_->handle_request(std::move(ctx), request);
+}
+
+inline void http_worker_handler::handle_close(shared_ptr<connection> conn)
+{
+    worker_->handle_close(conn);
+}
+
 class http_worker_factory
 {
 public:
     typedef shared_ptr<http_worker> worker_ptr;
 
+    typedef worker_connection connection_type;
+
     http_worker_factory()
         : index_(0)
+        , idle_release_(0)
     {
     }
 
     worker_ptr create(asio::io_context & context)
     {
-        return make_shared<http_worker>(context, index_++);
+        return ::make_shared<http_worker>(context, index_++, idle_release_);
     }
 
     size_t index_;
+
+    chrono::milliseconds idle_release_;
 };
 
+// http_server [--metrics] [--watchdog] [--idle-release <ms>] [handoff path]
 int main(int argc, char* argv[])
 {
     std::srand(std::time(nullptr));
 
+    std::string handoff;
+    bool metrics = false;
+    bool watchdog = false;
+    http_worker_factory factory;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--metrics") == 0)
+            metrics = true;
+        else if(std::strcmp(argv[i], "--watchdog") == 0)
+            watchdog = true;
+        else if(std::strcmp(argv[i], "--idle-release") == 0 && i + 1 < argc)
+            factory.idle_release_ = chrono::milliseconds(std::strtoull(argv[++i], nullptr, 10));
+        else
+            handoff = argv[i];
+    }
+
     try
     {
         tcp::endpoint endpoint{asio::ip::address::from_string("0.0.0.0"), 12345};
-        http_worker_factory factory;
         tcp_server<http_worker_factory> server{endpoint, factory};
 
         asio::signal_set sigs(server.get_io_context());
@@ -153,8 +217,33 @@ int main(int argc, char* argv[])
             server.stop();
         });
 
-        // Run the server until stopped.
-        server.start(true);
+        // Run the server until stopped. With a handoff path a new server
+        // started on the same path takes the listening socket over.
+        if(!handoff.empty() && ::access(handoff.c_str(), F_OK) == 0)
+            server.start_inherited(handoff);
+        else
+            server.start(true);
+
+        if(!handoff.empty())
+            server.enable_handoff(handoff);
+
+        // GET /metrics is answered by the workers in the Prometheus format
+        if(metrics)
+            server.enable_metrics("/metrics");
+
+        // sample one request in a hundred into a file read by trace_decode
+        // server.enable_tracing("http.trace", 100);
+
+        // report handlers holding a worker up for more than 50 ms
+        if(watchdog)
+            server.enable_watchdog(chrono::milliseconds(10), chrono::milliseconds(50));
+
+        // answer 503 while the workers are full or their event loops lag over 5 ms
+        // admission_limits limits;
+        // limits.max_connections = 10000;
+        // limits.max_in_flight = 1024;
+        // limits.target_delay = chrono::milliseconds(5);
+        // server.set_admission(limits);
 
         server.run();
     }
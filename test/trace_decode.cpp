@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <asio.h>
+#include <request_trace.h>
+
+// decode a file written by tcp_server::enable_tracing()
+//
+//     trace_decode <file> [summary|timeline|folded]
+//
+// summary prints percentiles of every stage, timeline the Chrome trace
+// event format for chrome://tracing or Perfetto, one track per connection,
+// and folded the input of flamegraph.pl, in microseconds per stage.
+
+struct stage
+{
+    const char * name_;
+
+    trace_point from_;
+
+    trace_point to_;
+};
+
+// the time between two points, a stage is left out when a point is missing
+// or a streamed body completes after the handler was invoked
+static const stage stages[] =
+{
+    {"accept", trace_accepted, trace_header_parsed},
+    {"read_body", trace_header_parsed, trace_body_complete},
+    {"dispatch", trace_body_complete, trace_handler_invoked},
+    {"handler", trace_handler_invoked, trace_committed},
+    {"wait_write", trace_committed, trace_write_started},
+    {"write", trace_write_started, trace_write_completed},
+};
+
+static bool duration(const trace_record & r, const stage & s, std::uint64_t & ticks)
+{
+    std::uint64_t from = r.stamps_[s.from_];
+    std::uint64_t to = r.stamps_[s.to_];
+    if(from == 0 || to == 0 || to < from)
+        return false;
+    ticks = to - from;
+    return true;
+}
+
+static void summary(const std::vector<trace_record> & records, double us)
+{
+    std::printf("%-12s %10s %10s %10s %10s %10s\n", "stage", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for(const stage & s : stages)
+    {
+        std::vector<std::uint64_t> ticks;
+        for(const trace_record & r : records)
+        {
+            std::uint64_t t;
+            if(duration(r, s, t))
+                ticks.push_back(t);
+        }
+        if(ticks.empty())
+            continue;
+
+        std::sort(ticks.begin(), ticks.end());
+        auto at = [&ticks, us](double q)
+        {
+            return ticks[std::min<std::size_t>(ticks.size() - 1, q * ticks.size())] * us;
+        };
+        std::printf("%-12s %10zu %10.1f %10.1f %10.1f %10.1f\n", s.name_, ticks.size(), at(0.5), at(0.9), at(0.99), ticks.back() * us);
+    }
+}
+
+static void timeline(const std::vector<trace_record> & records, double us)
+{
+    std::uint64_t origin = ~std::uint64_t(0);
+    for(const trace_record & r : records)
+        for(std::uint64_t t : r.stamps_)
+            if(t != 0)
+                origin = std::min(origin, t);
+
+    std::printf("{\"traceEvents\":[\n");
+    bool first = true;
+    for(const trace_record & r : records)
+    {
+        for(const stage & s : stages)
+        {
+            std::uint64_t t;
+            if(!duration(r, s, t))
+                continue;
+            std::printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", s.name_, r.worker_, r.connection_, (r.stamps_[s.from_] - origin) * us, t * us);
+            first = false;
+        }
+    }
+    std::printf("\n]}\n");
+}
+
+static void folded(const std::vector<trace_record> & records, double us)
+{
+    std::map<std::string, double> stacks;
+    for(const trace_record & r : records)
+    {
+        for(const stage & s : stages)
+        {
+            std::uint64_t t;
+            if(duration(r, s, t))
+                stacks["worker " + std::to_string(r.worker_) + ";" + s.name_] += t * us;
+        }
+    }
+    for(auto & i : stacks)
+        std::printf("%s %.0f\n", i.first.c_str(), i.second);
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <file> [summary|timeline|folded]\n";
+        return 1;
+    }
+    std::string mode = argc > 2 ? argv[2] : "summary";
+
+    std::FILE * file = std::fopen(argv[1], "rb");
+    if(file == nullptr)
+    {
+        std::perror(argv[1]);
+        return 1;
+    }
+
+    trace_file_header header;
+    if(std::fread(&header, sizeof(header), 1, file) != 1
+        || std::memcmp(header.magic_, trace_magic, sizeof(trace_magic)) != 0
+        || header.point_count_ != trace_point_count
+        || header.record_size_ != sizeof(trace_record))
+    {
+        std::cerr << argv[1] << ": not a trace file of this version\n";
+        return 1;
+    }
+
+    std::vector<trace_record> records;
+    trace_record r;
+    while(std::fread(&r, sizeof(r), 1, file) == 1)
+        records.push_back(r);
+    std::fclose(file);
+
+    double us = 1e6 / header.ticks_per_second_;
+    if(mode == "timeline")
+        timeline(records, us);
+    else if(mode == "folded")
+        folded(records, us);
+    else
+        summary(records, us);
+    return 0;
+}